@@ -0,0 +1,553 @@
+/*
+ * File: bench/latency.c
+ * Author: Shrehan Raj Singh
+ * Created: 19-10-2026
+ * Description: End-to-end input latency harness. Runs the real game in a
+ *              pseudo console, types scripted keys into it and reads the
+ *              console output back to see when each press shows up.
+ *
+ * Usage: tetris_latency <path to tetris.exe> [OPTIONS] [-- GAME OPTIONS]
+ *   --keys N        number of presses in the default script (100)
+ *   --interval MS   time between presses in the default script (50)
+ *   --script FILE   lines of "<ms from start> <left|right|down|up>"
+ *   --timeout MS    how long to wait for the last press to show (5000)
+ *
+ * The game runs with --check-alloc, so the run fails if the game loop
+ * allocates after its first frame.
+ *
+ * Needs Windows 10 1809 or later for CreatePseudoConsole(); no real
+ * console is required, so it also runs on headless CI agents.
+ */
+
+#define _WIN32_WINNT 0x0A00
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+
+#define GRID_W 160
+#define GRID_H 60
+#define MAX_KEYS 65536
+
+typedef struct
+{
+  double at_ms;    // when to press, from the start of the script
+  const char *seq; // VT input sequence for the key
+
+} script_key;
+
+script_key SCRIPT[MAX_KEYS];
+size_t script_len = 0;
+
+LONGLONG sent_at[MAX_KEYS]; // QPC ticks
+LONGLONG seen_at[MAX_KEYS];
+volatile LONG keys_sent = 0;
+volatile LONG keys_seen = 0;
+
+LONGLONG first_frame_at = 0, last_frame_at = 0;
+size_t first_frame = 0, last_frame = 0;
+
+LARGE_INTEGER qpc_freq;
+
+/*
+  Just enough of a VT terminal to follow what the pseudo console draws:
+  text, cursor movement and erases. Everything else is skipped.
+*/
+enum
+{
+  VT_GROUND,
+  VT_ESC,
+  VT_CHARSET,
+  VT_CSI,
+  VT_OSC,
+  VT_OSC_ESC,
+};
+
+char GRID[GRID_H][GRID_W + 1];
+int cur_r = 0, cur_c = 0;
+int vt_state = VT_GROUND;
+int vt_params[16];
+int vt_nparams = 0;
+
+LONGLONG
+now_ticks (void)
+{
+  LARGE_INTEGER c;
+  QueryPerformanceCounter (&c);
+  return c.QuadPart;
+}
+
+double
+ticks_ms (LONGLONG t)
+{
+  return t * 1000.0 / qpc_freq.QuadPart;
+}
+
+void
+grid_clear (int r0, int c0, int r1, int c1)
+{
+  for (int r = r0; r <= r1 && r < GRID_H; r++)
+    {
+      for (int c = (r == r0 ? c0 : 0); c < GRID_W; c++)
+        {
+          if (r == r1 && c > c1)
+            break;
+
+          GRID[r][c] = ' ';
+        }
+    }
+}
+
+void
+grid_newline (void)
+{
+  if (++cur_r < GRID_H)
+    return;
+
+  memmove (GRID[0], GRID[1], (GRID_H - 1) * sizeof (GRID[0]));
+  memset (GRID[GRID_H - 1], ' ', GRID_W);
+  cur_r = GRID_H - 1;
+}
+
+int
+vt_param (int i, int def)
+{
+  return i < vt_nparams && vt_params[i] > 0 ? vt_params[i] : def;
+}
+
+void
+vt_csi (char f)
+{
+  switch (f)
+    {
+    case 'H':
+    case 'f':
+      cur_r = vt_param (0, 1) - 1;
+      cur_c = vt_param (1, 1) - 1;
+      break;
+    case 'A':
+      cur_r -= vt_param (0, 1);
+      break;
+    case 'B':
+      cur_r += vt_param (0, 1);
+      break;
+    case 'C':
+      cur_c += vt_param (0, 1);
+      break;
+    case 'D':
+      cur_c -= vt_param (0, 1);
+      break;
+    case 'G':
+      cur_c = vt_param (0, 1) - 1;
+      break;
+    case 'd':
+      cur_r = vt_param (0, 1) - 1;
+      break;
+    case 'J':
+      if (vt_param (0, 0) == 0)
+        grid_clear (cur_r, cur_c, GRID_H - 1, GRID_W - 1);
+      else
+        grid_clear (0, 0, GRID_H - 1, GRID_W - 1);
+      break;
+    case 'K':
+      if (vt_param (0, 0) == 0)
+        grid_clear (cur_r, cur_c, cur_r, GRID_W - 1);
+      else if (vt_param (0, 0) == 1)
+        grid_clear (cur_r, 0, cur_r, cur_c);
+      else
+        grid_clear (cur_r, 0, cur_r, GRID_W - 1);
+      break;
+    case 'X':
+      grid_clear (cur_r, cur_c, cur_r, cur_c + vt_param (0, 1) - 1);
+      break;
+    default:
+      break; /* colours, modes, scroll regions */
+    }
+
+  if (cur_r < 0)
+    cur_r = 0;
+  if (cur_r >= GRID_H)
+    cur_r = GRID_H - 1;
+  if (cur_c < 0)
+    cur_c = 0;
+  if (cur_c >= GRID_W)
+    cur_c = GRID_W - 1;
+}
+
+void
+vt_feed (const char *buf, DWORD n)
+{
+  for (DWORD i = 0; i < n; i++)
+    {
+      unsigned char ch = buf[i];
+
+      switch (vt_state)
+        {
+        case VT_GROUND:
+          if (ch == 0x1b)
+            vt_state = VT_ESC;
+          else if (ch == '\r')
+            cur_c = 0;
+          else if (ch == '\n')
+            grid_newline ();
+          else if (ch == '\b')
+            cur_c -= cur_c > 0;
+          else if (ch == '\t')
+            cur_c = (cur_c / 8 + 1) * 8 < GRID_W ? (cur_c / 8 + 1) * 8
+                                                  : GRID_W - 1;
+          else if (ch >= 0x20 && (ch < 0x80 || ch >= 0xc0))
+            {
+              /* UTF-8 continuation bytes do not take a cell */
+              if (cur_c >= GRID_W)
+                {
+                  cur_c = 0;
+                  grid_newline ();
+                }
+
+              GRID[cur_r][cur_c++] = ch < 0x80 ? ch : '?';
+            }
+          break;
+
+        case VT_ESC:
+          vt_nparams = 1;
+          memset (vt_params, 0, sizeof (vt_params));
+
+          if (ch == '[')
+            vt_state = VT_CSI;
+          else if (ch == ']')
+            vt_state = VT_OSC;
+          else if (ch == '(' || ch == ')')
+            vt_state = VT_CHARSET;
+          else
+            vt_state = VT_GROUND;
+          break;
+
+        case VT_CHARSET:
+          vt_state = VT_GROUND;
+          break;
+
+        case VT_CSI:
+          if (ch >= '0' && ch <= '9')
+            vt_params[vt_nparams - 1]
+                = vt_params[vt_nparams - 1] * 10 + ch - '0';
+          else if (ch == ';' && vt_nparams < 16)
+            vt_nparams++;
+          else if (ch >= 0x40 && ch <= 0x7e)
+            {
+              vt_csi (ch);
+              vt_state = VT_GROUND;
+            }
+          break; /* '?' and other intermediates are ignored */
+
+        case VT_OSC:
+          if (ch == 0x07)
+            vt_state = VT_GROUND;
+          else if (ch == 0x1b)
+            vt_state = VT_OSC_ESC;
+          break;
+
+        case VT_OSC_ESC:
+          vt_state = VT_GROUND;
+          break;
+        }
+    }
+}
+
+// Finds the game's "KEYS: k  FRAME: f" line on screen
+int
+grid_marker (size_t *keys, size_t *frame)
+{
+  for (int r = 0; r < GRID_H; r++)
+    {
+      const char *p = strstr (GRID[r], "KEYS: ");
+
+      if (p != NULL && sscanf (p, "KEYS: %zu FRAME: %zu", keys, frame) == 2)
+        return 1;
+    }
+
+  return 0;
+}
+
+DWORD WINAPI
+output_reader (LPVOID args)
+{
+  HANDLE out = args;
+  char buf[4096];
+  DWORD n;
+
+  while (ReadFile (out, buf, sizeof (buf), &n, NULL) && n > 0)
+    {
+      LONGLONG t = now_ticks ();
+      size_t keys, frame;
+
+      vt_feed (buf, n);
+
+      if (!grid_marker (&keys, &frame))
+        continue;
+
+      if (first_frame_at == 0)
+        {
+          first_frame_at = t;
+          first_frame = frame;
+        }
+
+      last_frame_at = t;
+      last_frame = frame;
+
+      /* a press is visible once a frame counting it has been drawn */
+      while ((size_t)keys_seen < keys && keys_seen < keys_sent)
+        {
+          seen_at[keys_seen] = t;
+          InterlockedExchange (&keys_seen, keys_seen + 1);
+        }
+    }
+
+  return 0;
+}
+
+const char *
+key_seq (const char *name)
+{
+  if (!strcmp (name, "left"))
+    return "\x1b[D";
+  else if (!strcmp (name, "right"))
+    return "\x1b[C";
+  else if (!strcmp (name, "down"))
+    return "\x1b[B";
+  else if (!strcmp (name, "up"))
+    return "\x1b[A";
+
+  return NULL;
+}
+
+int
+load_script (const char *path)
+{
+  FILE *f = fopen (path, "r");
+  char name[32];
+  double at;
+
+  if (f == NULL)
+    return 1;
+
+  while (script_len < MAX_KEYS && fscanf (f, "%lf %31s", &at, name) == 2)
+    {
+      const char *seq = key_seq (name);
+
+      if (seq == NULL)
+        {
+          printf ("Unknown key `%s` in script\n", name);
+          fclose (f);
+          return 1;
+        }
+
+      SCRIPT[script_len++] = (script_key){ at, seq };
+    }
+
+  fclose (f);
+  return 0;
+}
+
+int
+cmp_ticks (const void *a, const void *b)
+{
+  LONGLONG x = *(const LONGLONG *)a, y = *(const LONGLONG *)b;
+  return (x > y) - (x < y);
+}
+
+int
+main (int argc, char const *argv[])
+{
+  if (argc < 2)
+    {
+      printf ("Usage: %s <path to tetris.exe> [--keys N] [--interval MS] "
+              "[--script FILE] [--timeout MS] [-- GAME OPTIONS]\n",
+              argv[0]);
+      return 1;
+    }
+
+  size_t keys = 100;
+  double interval = 50;
+  double timeout = 5000;
+  const char *script = NULL;
+  char cmd[4096];
+  int i = 2;
+
+  for (; i < argc; i++)
+    {
+      const char *s = argv[i];
+
+      if (!strcmp (s, "--"))
+        {
+          i++;
+          break;
+        }
+      else if (!strcmp (s, "--keys"))
+        {
+          assert (i < argc - 1);
+          keys = atoi (argv[++i]);
+        }
+      else if (!strcmp (s, "--interval"))
+        {
+          assert (i < argc - 1);
+          interval = atof (argv[++i]);
+        }
+      else if (!strcmp (s, "--script"))
+        {
+          assert (i < argc - 1);
+          script = argv[++i];
+        }
+      else if (!strcmp (s, "--timeout"))
+        {
+          assert (i < argc - 1);
+          timeout = atof (argv[++i]);
+        }
+    }
+
+  snprintf (cmd, sizeof (cmd), "\"%s\" --show-keys --check-alloc", argv[1]);
+
+  for (; i < argc; i++)
+    {
+      strncat (cmd, " ", sizeof (cmd) - strlen (cmd) - 1);
+      strncat (cmd, argv[i], sizeof (cmd) - strlen (cmd) - 1);
+    }
+
+  if (script != NULL)
+    {
+      if (load_script (script))
+        return 1;
+    }
+  else
+    {
+      /* alternate so the piece keeps moving instead of hitting a wall */
+      for (size_t k = 0; k < keys && k < MAX_KEYS; k++)
+        SCRIPT[script_len++] = (script_key){
+          500 + k * interval,
+          key_seq (k % 2 ? "right" : "left"),
+        };
+    }
+
+  QueryPerformanceFrequency (&qpc_freq);
+  memset (GRID, ' ', sizeof (GRID));
+  for (int r = 0; r < GRID_H; r++)
+    GRID[r][GRID_W] = '\0';
+
+  HANDLE in_read, in_write, out_read, out_write;
+  HPCON pty;
+
+  if (!CreatePipe (&in_read, &in_write, NULL, 0)
+      || !CreatePipe (&out_read, &out_write, NULL, 0)
+      || FAILED (CreatePseudoConsole ((COORD){ GRID_W, GRID_H }, in_read,
+                                      out_write, 0, &pty)))
+    {
+      printf ("Could not create a pseudo console\n");
+      return 1;
+    }
+
+  STARTUPINFOEXA si = { 0 };
+  PROCESS_INFORMATION pi = { 0 };
+  SIZE_T attr_size = 0;
+
+  si.StartupInfo.cb = sizeof (si);
+  InitializeProcThreadAttributeList (NULL, 1, 0, &attr_size);
+  si.lpAttributeList = malloc (attr_size);
+  InitializeProcThreadAttributeList (si.lpAttributeList, 1, 0, &attr_size);
+  UpdateProcThreadAttribute (si.lpAttributeList, 0,
+                             PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE, pty,
+                             sizeof (pty), NULL, NULL);
+
+  if (!CreateProcessA (NULL, cmd, NULL, NULL, FALSE,
+                       EXTENDED_STARTUPINFO_PRESENT, NULL, NULL,
+                       &si.StartupInfo, &pi))
+    {
+      printf ("Could not start `%s`\n", cmd);
+      return 1;
+    }
+
+  /* the pseudo console owns these ends now */
+  CloseHandle (in_read);
+  CloseHandle (out_write);
+
+  HANDLE reader = CreateThread (NULL, 0, output_reader, out_read, 0, NULL);
+  assert (reader != NULL);
+
+  LONGLONG start = now_ticks ();
+
+  for (size_t k = 0; k < script_len; k++)
+    {
+      LONGLONG due = start + SCRIPT[k].at_ms * qpc_freq.QuadPart / 1000;
+
+      /* sleep most of the way, spin the rest for an exact timestamp */
+      while (now_ticks () < due)
+        {
+          if (ticks_ms (due - now_ticks ()) > 2)
+            Sleep (1);
+        }
+
+      DWORD written;
+      sent_at[k] = now_ticks ();
+      InterlockedExchange (&keys_sent, k + 1);
+      WriteFile (in_write, SCRIPT[k].seq, strlen (SCRIPT[k].seq), &written,
+                 NULL);
+    }
+
+  LONGLONG deadline = now_ticks () + timeout * qpc_freq.QuadPart / 1000;
+
+  while ((size_t)keys_seen < script_len && now_ticks () < deadline)
+    Sleep (1);
+
+  /* --check-alloc aborts the game; a game over exits with 0 */
+  DWORD code = 0;
+
+  if (WaitForSingleObject (pi.hProcess, 0) == WAIT_OBJECT_0)
+    GetExitCodeProcess (pi.hProcess, &code);
+
+  TerminateProcess (pi.hProcess, 0);
+  ClosePseudoConsole (pty);
+  WaitForSingleObject (reader, INFINITE);
+
+  CloseHandle (reader);
+  CloseHandle (in_write);
+  CloseHandle (out_read);
+  CloseHandle (pi.hProcess);
+  CloseHandle (pi.hThread);
+  DeleteProcThreadAttributeList (si.lpAttributeList);
+  free (si.lpAttributeList);
+
+  size_t seen = keys_seen;
+
+  if (code != 0)
+    {
+      printf ("The game exited with code %lu\n", code);
+      return 1;
+    }
+
+  if (seen == 0)
+    {
+      printf ("No key press became visible\n");
+      return 1;
+    }
+
+  static LONGLONG lat[MAX_KEYS];
+
+  for (size_t k = 0; k < seen; k++)
+    lat[k] = seen_at[k] - sent_at[k];
+
+  qsort (lat, seen, sizeof (lat[0]), cmp_ticks);
+
+  double fps = last_frame_at > first_frame_at
+                   ? (last_frame - first_frame)
+                         / (ticks_ms (last_frame_at - first_frame_at) / 1000)
+                   : 0;
+
+  printf ("keys: %zu sent, %zu visible\n", script_len, seen);
+  printf ("input to screen: p50 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+          ticks_ms (lat[(seen - 1) * 50 / 100]),
+          ticks_ms (lat[(seen - 1) * 99 / 100]), ticks_ms (lat[seen - 1]));
+  printf ("frames: %.1f per second\n", fps);
+
+  return seen == script_len ? 0 : 1;
+}
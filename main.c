@@ -6,21 +6,59 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
+#include <io.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include <windows.h>
+#include <mmsystem.h>
 
-int ROW = 20;
-int COLUMN = 20;
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+#endif
 
-int keyLeft = VK_LEFT;
-int keyRight = VK_RIGHT;
-int keyDown = VK_DOWN;
-int keyShift = VK_UP;
-int showScore = 1;
+#include "tetris.h"
+
+#ifndef TETRIS_NO_MAIN
+static int ROW = 20;
+static int COLUMN = 20;
+#endif
+
+/*
+  Board sizes (ROW, COLUMN) that get their own copy of the board loops,
+  compiled with constant dimensions; anything else runs the generic copy.
+  The *_n functions are forced inline into each copy so the bounds fold.
+  The copies cover building, drawing, packing and locking the board, with
+  its line clears, cascades and scrolling. Collision checks walk SHAPES[]
+  rather than the board and stay shared.
+*/
+#define BOARD_VARIANTS(X)                                                     \
+  X (20, 20)                                                                  \
+  X (10, 20)                                                                  \
+  X (20, 10)
+
+#ifdef __GNUC__
+#define BOARD_INLINE static inline __attribute__ ((always_inline))
+#else
+#define BOARD_INLINE static __forceinline
+#endif
+
+#ifndef TETRIS_NO_MAIN
+static int keyLeft = VK_LEFT;
+static int keyRight = VK_RIGHT;
+static int keyDown = VK_DOWN;
+static int keyShift = VK_UP;
+static int keyUndo = VK_BACK;
+static int showScore = 1;
+static int showKeys = 0;
+
+/* delayed auto-shift and auto-repeat rate, in milliseconds */
+static int dasDelay = 170;
+static int arrRate = 50;
+#endif
 
 enum ShapeType
 {
@@ -72,6 +110,34 @@ enum ShapeType
   TOTAL_SHAPES,
 };
 
+/*
+  Cells covered by each shape, as (row, column) offsets from pos_r/pos_c.
+  Mirrors the tests in bounded_shapeidx(); lets a board be rasterised by
+  stamping shapes rather than probing every cell.
+*/
+static const int SHAPE_CELLS[TOTAL_SHAPES][5][2] = {
+  [SHAPE_VLINE] = { { 0, 0 }, { 1, 0 }, { 2, 0 } },
+  [SHAPE_HLINE] = { { 0, 0 }, { 0, 1 }, { 0, 2 } },
+  [SHAPE_L_WITHLONGHLINE] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 1, 2 } },
+  [SHAPE_L_WITHLONGVLINE] = { { 0, 0 }, { 1, 0 }, { 2, 0 }, { 2, 1 } },
+  [SHAPE_T_VERTICAL] = { { 0, 0 }, { 0, 1 }, { 0, 2 }, { 1, 1 }, { 2, 1 } },
+  [SHAPE_T_HORIZONTAL] = { { 0, 0 }, { 1, 0 }, { 2, 0 }, { 1, 1 }, { 1, 2 } },
+  [SHAPE_T_MIRROR] = { { 0, 0 }, { 1, 0 }, { 2, 0 }, { 2, -1 }, { 2, 1 } },
+  [SHAPE_T_HORIZONTAL_MIRROR]
+  = { { 0, 0 }, { 0, 1 }, { 0, 2 }, { -1, 2 }, { 1, 2 } },
+};
+
+static const int SHAPE_CELL_COUNT[TOTAL_SHAPES] = {
+  [SHAPE_VLINE] = 3,
+  [SHAPE_HLINE] = 3,
+  [SHAPE_L_WITHLONGHLINE] = 4,
+  [SHAPE_L_WITHLONGVLINE] = 4,
+  [SHAPE_T_VERTICAL] = 5,
+  [SHAPE_T_HORIZONTAL] = 5,
+  [SHAPE_T_MIRROR] = 5,
+  [SHAPE_T_HORIZONTAL_MIRROR] = 5,
+};
+
 typedef struct
 {
   int type;
@@ -82,28 +148,437 @@ typedef struct
 
 } shape;
 
+#ifndef TETRIS_NO_MAIN
 // Empty space -> 0, Block -> 1
-int **SCREEN;
+static int **SCREEN;
 
-shape SHAPES[64];
-size_t shape_count = 0;
+/*
+  SCREEN is a ring of row pointers; logical row 0 (the top) lives at
+  SCREEN[screen_base]. Clearing a line moves row pointers on whichever
+  side of it is shorter and scrolling just moves the base.
+*/
+static size_t screen_base = 0;
+#define SCREEN_AT(r, c) SCREEN[(screen_base + (r)) % ROW][c]
+/* for the *_n board loops, which take the board size as parameters */
+#define SCREEN_AT_N(r, c, rows) SCREEN[(screen_base + (r)) % (rows)][c]
+
+/*
+  Endless mode: landed shapes are baked into SCREEN and dropped from
+  SHAPES[], and when the stack gets within ENDLESS_MARGIN rows of the top
+  the board scrolls, retiring its bottom row into the counters below.
+*/
+static int endlessMode = 0;
+#define ENDLESS_MARGIN 5
+#define LOCKED_CELL -2
 
-shape *curr_falling_shape = NULL;
+/*
+  Cascade mode: cleared lines are emptied in place and every group of
+  connected cells that no longer reaches the floor falls on its own until
+  it lands, which may complete more lines. Only the groups touching the
+  cleared lines are flooded. Cells are indexed r * COLUMN + c; CC_* are
+  sized once, with room for one group per cell.
+*/
+static int cascadeMode = 0;
+#define CC_HELD -2
+static int *CC_LABEL;  // group of a flooded cell, CC_HELD, or -1
+static int *CC_CELLS;  // flooded cells, each group a contiguous run
+static int *CC_START;  // first CC_CELLS entry of a group
+static int *CC_END;    // one past its last entry
+static int *CC_BOTTOM; // lowest row of a group
+static int *CC_SHIFT;  // rows a group has fallen
+static int *CC_ORDER;  // groups, lowest first
+static int *CC_LINES;  // lines emptied by the last clear or settle
+
+// Landed shapes are baked into SCREEN rather than kept in SHAPES[]
+#define LOCKED_BOARD (endlessMode || cascadeMode)
+
+static size_t LINES = 0;
+static size_t RETIRED_ROWS = 0;
+static size_t RETIRED_CELLS = 0;
+#endif
 
-void print_screen (void);
-void clrscr (void);
+/*
+  Every buffer the game loop uses is carved out of one block sized in
+  arena_init(), before the first frame, so play itself never allocates.
+  ALLOCS counts every malloc(), calloc() and realloc() in this file, through
+  the counting wrappers below; MSVC debug builds count every CRT allocation
+  with an allocation hook instead. --check-alloc aborts if it moves after
+  the first frame.
+*/
+#define INPUT_BATCH 64
 
-void add_shape (shape);
-int bounded_shapeidx (int, int);
-int shape_boundary_check (shape *, int);
-void drop_shape (void);
+typedef struct
+{
+  unsigned char *base;
+  size_t used;
+  size_t size;
 
-DWORD WINAPI keycatch (LPVOID);
+} arena;
 
-int GAMEOVER = 0;
-size_t SCORE = 0;
+static volatile LONG ALLOCS = 0;
+#ifndef TETRIS_NO_MAIN
+static arena ARENA;
+static int checkAlloc = 0;
+#endif
 
-int
+#if !defined(_MSC_VER) || !defined(_DEBUG)
+static void *
+counted_malloc (size_t n)
+{
+  InterlockedIncrement (&ALLOCS);
+  return malloc (n);
+}
+
+static void *
+counted_calloc (size_t n, size_t size)
+{
+  InterlockedIncrement (&ALLOCS);
+  return calloc (n, size);
+}
+
+#ifndef TETRIS_NO_MAIN
+static void *
+counted_realloc (void *p, size_t n)
+{
+  InterlockedIncrement (&ALLOCS);
+  return realloc (p, n);
+}
+
+#define realloc(p, n) counted_realloc (p, n)
+#endif
+
+#define malloc(n) counted_malloc (n)
+#define calloc(n, size) counted_calloc (n, size)
+#endif
+
+/* the game; the tetrisenv library (TETRIS_NO_MAIN) only has the batch code */
+#ifndef TETRIS_NO_MAIN
+static INPUT_RECORD *INPUT_BUF;    // INPUT_BATCH console events
+static char *FRAME_BUF;            // one rendered frame
+static size_t FRAME_SIZE;
+
+#define MAX_SHAPES 64
+
+static shape *SHAPES; // MAX_SHAPES, from the arena
+static size_t shape_count = 0;
+
+/*
+  Landed shapes stay in SHAPES[] outside endless and cascade mode, so
+  finding what covers a cell meant scanning them all. SHAPE_COVER counts
+  the shapes over each board cell (r * COLUMN + c) and SHAPES_OUTSIDE the
+  shape cells off the board; every change to SHAPES[] goes through
+  shape_cover() to keep them in step. SHAPE_ROWS has bit c of row r set
+  while SHAPE_COVER is, for the first 64 columns.
+*/
+static unsigned char *SHAPE_COVER;
+static unsigned long long *SHAPE_ROWS;
+static size_t SHAPES_OUTSIDE = 0;
+#define SHAPE_CELL -3
+
+static shape *curr_falling_shape = NULL;
+static int next_shape_type = SHAPE_HLINE; // preview
+
+/*
+  Key events are timestamped by `keycatch` and queued here; the game loop
+  consumes them in timestamp order, so a move lands at the time the key
+  was pressed and not whenever the game happens to look at it.
+  Single producer (keycatch), single consumer (main loop). When the queue
+  is full only presses are dropped; a release waits for room, or the key
+  would stay held and repeat forever. `keyq_ready` is set after each batch
+  so the game loop can sleep until input arrives.
+*/
+typedef struct
+{
+  int key;
+  int down;
+  LONGLONG t; // microseconds
+
+} key_event;
+
+#define KEYQ_SIZE 256
+
+static key_event KEYQ[KEYQ_SIZE];
+static volatile LONG keyq_head = 0;
+static volatile LONG keyq_tail = 0;
+static HANDLE keyq_ready;
+
+// Keys with engine-side repeat (DAS/ARR)
+enum
+{
+  HELD_LEFT,
+  HELD_RIGHT,
+  HELD_DOWN,
+  HELD_UNDO,
+  TOTAL_HELD,
+};
+
+typedef struct
+{
+  int held;
+  LONGLONG next_repeat; // microseconds
+
+} key_state;
+
+static key_state HELD[TOTAL_HELD];
+static int shift_held = 0; // rotation acts on the press only and never repeats
+
+static LARGE_INTEGER qpc_freq;
+
+#define TICK_US 200000LL
+
+/*
+  Rewind history: a ring of per-tick records holding only the shapes that
+  changed that tick, plus a ring of full keyframes taken every
+  KEYFRAME_EVERY ticks (or early, when a tick changes too many shapes).
+  Seeking costs one keyframe copy and at most KEYFRAME_EVERY deltas.
+
+  With a locked board the landed cells live on SCREEN, so ticks also
+  record the SCREEN rows that changed, bit-packed, and keyframes the
+  whole board. A line clear or scroll moves every row above it and just
+  takes a keyframe.
+*/
+#define HISTORY_TICKS 4096
+#define KEYFRAME_EVERY 32
+#define KEYFRAME_SLOTS (HISTORY_TICKS / KEYFRAME_EVERY * 2)
+#define MAX_TICK_DELTA 4
+#define MAX_ROW_DELTA 4
+
+typedef struct
+{
+  unsigned char idx;
+  shape s;
+
+} shape_delta;
+
+typedef struct
+{
+  size_t tick;
+  size_t kf_tick; // keyframe this tick replays from
+  size_t kf_slot;
+
+  size_t shape_count;
+  size_t score;
+  size_t pieces;
+  size_t ticks;
+  size_t lines;
+  size_t retired_rows;
+  size_t retired_cells;
+
+  unsigned char n;
+  shape_delta d[MAX_TICK_DELTA];
+
+  unsigned char rows_n;
+  int rows[MAX_ROW_DELTA]; // contents in HIST_ROWS
+
+} history_tick;
+
+typedef struct
+{
+  size_t tick;
+  size_t shape_count;
+  size_t score;
+  size_t pieces;
+  size_t ticks;
+  size_t lines;
+  size_t retired_rows;
+  size_t retired_cells;
+  shape shapes[MAX_SHAPES]; // board in KF_BOARDS
+
+} history_keyframe;
+
+static history_tick *HISTORY;         // HISTORY_TICKS, from the arena
+static history_keyframe *KEYFRAMES;   // KEYFRAME_SLOTS, from the arena
+static size_t kf_next = 0;
+
+static shape *hist_prev; // SHAPES as of the last recorded tick
+static size_t hist_prev_count = 0;
+static size_t hist_tick = 0; // last recorded tick
+static size_t hist_first = 0; // oldest tick still reachable
+static int hist_empty = 1;
+
+/* locked board only, rows of hist_row_bytes; hist_row_bytes is 0 otherwise */
+static size_t hist_row_bytes = 0;
+static unsigned char *HIST_ROWS;  // MAX_ROW_DELTA rows per history tick
+static unsigned char *KF_BOARDS;  // ROW rows per keyframe slot
+static unsigned char *hist_board; // SCREEN as of the last recorded tick
+static unsigned char *hist_row;   // scratch
+
+static void print_screen (void);
+static void check_gameover (void);
+static void reset_game (void);
+
+static unsigned long long config_hash (void);
+static int results_open (const char *);
+static void results_append (void);
+static void results_flush (void);
+static void results_close (void);
+static int results_index_update (const char *);
+static int leaderboard (const char *, int);
+
+static void select_board_variant (void);
+static void (*build_screen) (void);
+static void (*pack_board) (unsigned char *, size_t);
+static char *(*draw_board) (char *);
+static void (*lock_landed_shapes) (void);
+static int export_dataset (const char *, unsigned long long);
+static void clrscr (void);
+
+static void *game_alloc (size_t);
+static void *arena_alloc (size_t);
+static void arena_init (void);
+
+static void add_shape (shape);
+static int rotated_type (int);
+static size_t shape_score (int);
+static int bounded_shapeidx (int, int);
+static void shape_cover (const shape *, int);
+static void shape_cover_rebuild (void);
+static void shape_place (shape *, int, int, int);
+static int shape_boundary_check (shape *, int);
+static void drop_shape (void);
+
+static DWORD WINAPI keycatch (LPVOID);
+static LONGLONG now_us (void);
+static shape *falling_shape (void);
+static int move_shape (int);
+static int held_index (int);
+static int held_key (int);
+static int input_advance (LONGLONG);
+static LONGLONG input_deadline (LONGLONG);
+static int apply_key (int);
+
+static void history_record (void);
+static int history_seek (size_t);
+static size_t history_rewind (size_t);
+
+static int GAMEOVER = 0;
+static size_t SCORE = 0;
+static size_t PIECES = 0;
+static size_t KEYS_APPLIED = 0; // presses the game loop has consumed
+static size_t FRAMES = 0;
+static size_t TICKS = 0;
+static unsigned int gameSeed = 0;
+
+/*
+  Results log (--results): one fixed 64-byte record per finished game,
+  appended and never rewritten. The log is opened for appending only, so
+  each batch lands at the end as one write and several games or exporters
+  can share it. Each record carries a checksum so a torn write is detected
+  and skipped; a partial tail left by a crash is padded out to a record
+  boundary when the log is next opened.
+
+  <log>.idx holds every valid record as (config hash, score, record no)
+  in sorted runs, appended one after another, each behind a header saying
+  how many log records are covered up to its end. An update sorts the
+  newer records into a new run, first merging in the runs at the tail
+  that are no bigger than it, so run sizes shrink geometrically and there
+  are O(log N) of them; each entry is rewritten O(log N) times in all.
+  A run torn by a crash is cut off and rebuilt from the log.
+  --leaderboard answers top-K, percentile and histogram queries by binary
+  search in every run.
+*/
+#define RESULT_MAGIC 0x53525443       /* "CTRS" */
+#define RESULT_INDEX_MAGIC 0x58525443 /* "CTRX" */
+#define RESULT_RUN_MAGIC 0x4e525443   /* "CTRN" */
+#define RESULT_INDEX_VERSION 2
+#define MAX_RESULT_RUNS 64
+#define HISTOGRAM_BUCKETS 10
+
+typedef struct
+{
+  unsigned int magic;
+  unsigned int checksum; // over everything after this field
+  unsigned long long seed;
+  unsigned long long score;
+  unsigned long long lines;
+  unsigned long long pieces;
+  unsigned long long duration_ms;
+  unsigned long long config_hash;
+  unsigned long long reserved;
+
+} result_record;
+
+typedef struct
+{
+  unsigned long long config_hash;
+  unsigned long long score;
+  unsigned long long record;
+
+} result_entry;
+
+typedef struct
+{
+  unsigned int magic;
+  unsigned int version;
+
+} result_index_header;
+
+typedef struct
+{
+  unsigned int magic;
+  unsigned int reserved;
+  unsigned long long records; // log records covered, by this run and before
+  unsigned long long count;   // entries that follow
+
+} result_run_header;
+
+typedef struct
+{
+  long long offset; // of the first entry
+  unsigned long long count;
+  unsigned long long lo, hi; // entries of the config being queried
+
+} result_run;
+
+static const char *resultsPath = "tetris.results";
+static HANDLE RESULTS = INVALID_HANDLE_VALUE;
+
+/* records wait here and go out in one write, export logs many per second */
+#define RESULTS_BATCH 256
+
+static result_record RESULTS_PENDING[RESULTS_BATCH];
+static size_t results_pending = 0;
+
+/*
+  Dataset export (--export-dataset). Headless self-play with a random
+  policy, one sample per tick, written in chunks by a background thread
+  so the simulator only waits if the disk falls two chunks behind.
+
+  File layout (little endian):
+    header     "CTDS", u32 version, rows, cols, row_bytes, sample_bytes,
+               chunk_samples, reserved
+    chunks     u32 sample count, u32 reserved, samples...
+    index      per chunk: u64 file offset, u64 first sample
+    footer     u64 index offset, u64 chunks, u64 samples, "CTDX", u32 0
+
+  Sample: board (bit-packed rows, bit j of a row is column j), u8 piece
+  type, u8 preview type, i16 piece row, i16 piece column, u8 action,
+  u8 done, i32 reward (score gained this tick).
+*/
+#define DS_VERSION 1
+#define DS_CHUNK_SAMPLES 4096
+
+typedef struct
+{
+  FILE *f;
+  unsigned char *buf[2];
+  size_t len[2];
+  int cur;
+  int pending;
+  int quit;
+
+  HANDLE ready; // a chunk was handed to the writer
+  HANDLE done;  // the writer is idle
+
+  unsigned long long offset; // file offset of the next chunk
+  unsigned long long samples;
+  unsigned long long *index;
+  size_t chunks;
+  size_t index_cap;
+
+} ds_writer;
+
+static int
 rand_range (int l1, int l2)
 {
   return rand () % (l1 + 1 - l2) + l1;
@@ -115,50 +590,92 @@ main (int argc, char const *argv[])
   if (argc == 1)
     {
     L1:;
-      SCREEN = malloc (ROW * sizeof (int *));
-
-      for (size_t i = 0; i < ROW; i++)
-        {
-          SCREEN[i] = malloc (COLUMN * sizeof (int));
+      select_board_variant ();
+      arena_init ();
 
-          for (size_t j = 0; j < COLUMN; j++)
-            SCREEN[i][j] = 0;
-        }
+      gameSeed = time (NULL);
+      srand (gameSeed);
+      QueryPerformanceFrequency (&qpc_freq);
 
-      srand (time (NULL));
+      /* 1 ms waits instead of the default 15.6 ms scheduler tick */
+      timeBeginPeriod (1);
+      keyq_ready = CreateEvent (NULL, FALSE, FALSE, NULL);
+      assert (keyq_ready != NULL);
 
       DWORD keyThID;
       HANDLE keyHandle = CreateThread (NULL, 0, keycatch, NULL, 0, &keyThID);
 
       assert (keyHandle != NULL);
 
-      // add a test shape
-      add_shape ((shape){
-          .pos_c = 1,
-          .pos_r = 1,
-          .type = SHAPE_HLINE,
-          .is_falling = 1,
-      });
-      curr_falling_shape = SHAPES;
+      reset_game ();
+      history_record ();
+
+      LONGLONG next_tick = now_us () + TICK_US;
+      int redraw = 1;
+
+      LONG allocs_at_first_frame = -1;
 
       while (!GAMEOVER)
         {
-          clrscr ();
-          print_screen ();
+          if (redraw)
+            {
+              clrscr ();
+              print_screen ();
+              redraw = 0;
+
+              if (allocs_at_first_frame == -1)
+                allocs_at_first_frame = ALLOCS;
+              else if (checkAlloc && ALLOCS != allocs_at_first_frame)
+                {
+                  fprintf (stderr, "Allocated after the first frame\n");
+                  abort ();
+                }
+            }
+
+          LONGLONG t = now_us ();
 
+          if (t < next_tick)
+            {
+              redraw = input_advance (t);
+
+              /* sleep until the next tick or repeat, or new input */
+              if (!redraw)
+                WaitForSingleObject (
+                    keyq_ready, (input_deadline (next_tick) - t + 999) / 1000);
+              continue;
+            }
+
+          /* apply everything that happened before the tick, then drop */
+          input_advance (next_tick);
           drop_shape ();
+          history_record ();
 
-          Sleep (200);
+          next_tick += TICK_US;
+          redraw = 1;
         }
 
       clrscr ();
       print_screen ();
 
+      if (!results_open (resultsPath))
+        {
+          results_append ();
+          results_close ();
+        }
+
+      /* keycatch sees GAMEOVER and stops signalling keyq_ready */
+      WaitForSingleObject (keyHandle, INFINITE);
       CloseHandle (keyHandle);
+      CloseHandle (keyq_ready);
+      timeEndPeriod (1);
     }
   else
     {
       int helpFlag = 0;
+      const char *exportPath = NULL;
+      unsigned long long exportSamples = 1000000;
+      int leaderboardFlag = 0;
+      int topK = 10;
 
       for (size_t i = 0; i < argc; i++)
         {
@@ -203,6 +720,12 @@ main (int argc, char const *argv[])
               keyShift = (int)*argv[i + 1];
             }
 
+          else if (!strcmp (s, "--key-undo") || !strcmp (s, "-ku"))
+            {
+              assert (i < argc - 1);
+              keyUndo = (int)*argv[i + 1];
+            }
+
           else if (!strcmp (s, "--show-score") || !strcmp (s, "-ss"))
             {
               assert (i < argc - 1);
@@ -226,6 +749,57 @@ main (int argc, char const *argv[])
                 }
             }
 
+          else if (!strcmp (s, "--das"))
+            {
+              assert (i < argc - 1);
+              dasDelay = atoi (argv[i + 1]);
+            }
+
+          else if (!strcmp (s, "--arr"))
+            {
+              assert (i < argc - 1);
+              arrRate = atoi (argv[i + 1]);
+            }
+
+          else if (!strcmp (s, "--export-dataset"))
+            {
+              assert (i < argc - 1);
+              exportPath = argv[i + 1];
+            }
+
+          else if (!strcmp (s, "--samples"))
+            {
+              assert (i < argc - 1);
+              exportSamples = strtoull (argv[i + 1], NULL, 10);
+            }
+
+          else if (!strcmp (s, "--results"))
+            {
+              assert (i < argc - 1);
+              resultsPath = argv[i + 1];
+            }
+
+          else if (!strcmp (s, "--leaderboard"))
+            leaderboardFlag = 1;
+
+          else if (!strcmp (s, "--top"))
+            {
+              assert (i < argc - 1);
+              topK = atoi (argv[i + 1]);
+            }
+
+          else if (!strcmp (s, "--endless"))
+            endlessMode = 1;
+
+          else if (!strcmp (s, "--cascade"))
+            cascadeMode = 1;
+
+          else if (!strcmp (s, "--show-keys"))
+            showKeys = 1;
+
+          else if (!strcmp (s, "--check-alloc"))
+            checkAlloc = 1;
+
           else if (!strcmp (s, "--wasd"))
             {
               keyShift = 'W';
@@ -249,8 +823,37 @@ main (int argc, char const *argv[])
           printf (
               "  -kd, --key-down\t\t\tSet the key to move the shape down\n");
           printf ("  -ks, --key-shift\t\t\tSet the key to shift the shape\n");
+          printf ("  -ku, --key-undo\t\t\tSet the key to rewind the game\n");
           printf ("  -ss, --show-score\t\t\tShow the score\n");
           printf ("  --wasd\t\t\t\tUse standard WASD (ASD) layout\n");
+          printf ("  --show-keys\t\t\t\tShow key presses and frames drawn "
+                  "so far\n");
+          printf ("  --check-alloc\t\t\t\tAbort if anything is allocated "
+                  "after the first frame\n");
+          printf ("  --das\t\t\t\t\tDelay before a held key repeats (ms)\n");
+          printf ("  --arr\t\t\t\t\tInterval between repeats (ms, 0 = "
+                  "instant)\n");
+          printf ("  --export-dataset\t\t\tWrite self-play samples to a "
+                  "file and exit\n");
+          printf ("  --samples\t\t\t\tNumber of samples to export\n");
+          printf ("  --endless\t\t\t\tScroll the board instead of "
+                  "ending the game\n");
+          printf ("  --cascade\t\t\t\tLoose blocks fall after a line "
+                  "clear\n");
+          printf ("  --results\t\t\t\tFile finished games are logged to\n");
+          printf ("  --leaderboard\t\t\t\tShow top scores and percentiles "
+                  "for these options\n");
+          printf ("  --top\t\t\t\t\tNumber of leaderboard entries\n");
+        }
+      else if (leaderboardFlag)
+        {
+          if (leaderboard (resultsPath, topK))
+            printf ("No results in `%s`\n", resultsPath);
+        }
+      else if (exportPath != NULL)
+        {
+          if (export_dataset (exportPath, exportSamples))
+            printf ("Could not write dataset to `%s`\n", exportPath);
         }
       else
         goto L1;
@@ -260,170 +863,809 @@ end:
   return 0;
 }
 
+#if defined(_MSC_VER) && defined(_DEBUG)
+static int
+crt_alloc_hook (int type, void *data, size_t size, int block, long req,
+                const unsigned char *file, int line)
+{
+  if (type != _HOOK_FREE)
+    InterlockedIncrement (&ALLOCS);
+  return TRUE;
+}
+#endif
+
+static void *
+game_alloc (size_t n)
+{
+  void *p = malloc (n);
+
+  assert (p != NULL);
+  return p;
+}
+
+static void *
+arena_alloc (size_t n)
+{
+  size_t at = (ARENA.used + 15) & ~(size_t)15;
+
+  assert (at + n <= ARENA.size);
+  ARENA.used = at + n;
+  return ARENA.base + at;
+}
+
+/* sizes every buffer from ROW/COLUMN and the mode flags in one block */
+static void
+arena_init (void)
+{
+  size_t frame = (ROW + 2) * (COLUMN * 2 + 4) + 256;
+  size_t cells = ROW * COLUMN;
+  size_t rb = LOCKED_BOARD ? (COLUMN + 7) / 8 : 0;
+  size_t size = 16 * 16 + 2 * MAX_SHAPES * sizeof (shape)
+                + HISTORY_TICKS * sizeof (history_tick)
+                + KEYFRAME_SLOTS * sizeof (history_keyframe)
+                + (HISTORY_TICKS * MAX_ROW_DELTA + KEYFRAME_SLOTS * ROW
+                   + ROW + 1)
+                      * rb
+                + ROW * sizeof (int *) + cells * sizeof (int) + cells
+                + ROW * sizeof (unsigned long long)
+                + (cascadeMode ? (7 * cells + ROW) * sizeof (int) : 0)
+                + INPUT_BATCH * sizeof (INPUT_RECORD) + frame;
+
+  free (ARENA.base);
+  ARENA.base = game_alloc (size);
+  ARENA.used = 0;
+  ARENA.size = size;
+  memset (ARENA.base, 0, size);
+
+  SHAPES = arena_alloc (MAX_SHAPES * sizeof (shape));
+  SHAPE_COVER = arena_alloc (cells);
+  SHAPE_ROWS = arena_alloc (ROW * sizeof (unsigned long long));
+  SHAPES_OUTSIDE = 0;
+  hist_prev = arena_alloc (MAX_SHAPES * sizeof (shape));
+  HISTORY = arena_alloc (HISTORY_TICKS * sizeof (history_tick));
+  KEYFRAMES = arena_alloc (KEYFRAME_SLOTS * sizeof (history_keyframe));
+
+  hist_row_bytes = rb;
+  HIST_ROWS = arena_alloc (HISTORY_TICKS * MAX_ROW_DELTA * rb);
+  KF_BOARDS = arena_alloc (KEYFRAME_SLOTS * ROW * rb);
+  hist_board = arena_alloc (ROW * rb);
+  hist_row = arena_alloc (rb);
+
+  SCREEN = arena_alloc (ROW * sizeof (int *));
+  int *screen_cells = arena_alloc (cells * sizeof (int));
+
+  for (size_t i = 0; i < ROW; i++)
+    SCREEN[i] = screen_cells + i * COLUMN;
+  screen_base = 0;
+
+  if (cascadeMode)
+    {
+      int *cc = arena_alloc ((7 * cells + ROW) * sizeof (int));
+
+      CC_LABEL = cc;
+      CC_CELLS = cc + cells;
+      CC_START = cc + 2 * cells;
+      CC_END = cc + 3 * cells;
+      CC_BOTTOM = cc + 4 * cells;
+      CC_SHIFT = cc + 5 * cells;
+      CC_ORDER = cc + 6 * cells;
+      CC_LINES = cc + 7 * cells;
+
+      for (size_t i = 0; i < cells; i++)
+        CC_LABEL[i] = -1;
+    }
+
+  INPUT_BUF = arena_alloc (INPUT_BATCH * sizeof (INPUT_RECORD));
+  FRAME_BUF = arena_alloc (frame);
+  FRAME_SIZE = frame;
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+  static int hooked = 0;
+
+  if (!hooked)
+    {
+      _CrtSetAllocHook (crt_alloc_hook);
+      hooked = 1;
+    }
+#endif
+}
+
+static LONGLONG
+now_us (void)
+{
+  LARGE_INTEGER c;
+  QueryPerformanceCounter (&c);
+
+  /* split to avoid overflowing on long uptimes */
+  return (c.QuadPart / qpc_freq.QuadPart) * 1000000LL
+         + (c.QuadPart % qpc_freq.QuadPart) * 1000000LL / qpc_freq.QuadPart;
+}
+
 // arrow keys to move, <esc> to quit
-DWORD WINAPI
+static DWORD WINAPI
 keycatch (LPVOID args)
 {
-  int c;
-
   HANDLE stdIn = GetStdHandle (STD_INPUT_HANDLE);
   DWORD ev = 0;
   DWORD ev_read = 0;
 
   while (!GAMEOVER)
     {
+      /* signalled while input is pending; time out to see GAMEOVER */
+      if (WaitForSingleObject (stdIn, 100) != WAIT_OBJECT_0)
+        continue;
+
       GetNumberOfConsoleInputEvents (stdIn, &ev);
 
       if (ev != 0)
         {
-          INPUT_RECORD ev_buf[ev];
-          ReadConsoleInput (stdIn, ev_buf, ev, &ev_read);
+          INPUT_RECORD *ev_buf = INPUT_BUF;
+          ReadConsoleInput (stdIn, ev_buf, ev < INPUT_BATCH ? ev : INPUT_BATCH,
+                            &ev_read);
+
+          LONGLONG t = now_us ();
 
           for (DWORD i = 0; i < ev_read; i++)
             {
-              if (ev_buf[i].EventType == KEY_EVENT
-                  && ev_buf[i].Event.KeyEvent.bKeyDown)
+              if (ev_buf[i].EventType != KEY_EVENT)
+                continue;
+
+              LONG tail = keyq_tail;
+
+              if (tail - keyq_head == KEYQ_SIZE)
                 {
-                  if (curr_falling_shape != NULL
-                      && curr_falling_shape->is_falling)
-                    ;
-                  else
-                    for (int i = shape_count - 1; i >= 0; i--)
-                      {
-                        if (SHAPES[i].is_falling)
-                          curr_falling_shape = &SHAPES[i];
-                      }
-
-                  if (ev_buf[i].Event.KeyEvent.wVirtualKeyCode == keyLeft)
-                    {
-                      if (curr_falling_shape->pos_c > 0
-                          && shape_boundary_check (curr_falling_shape,
-                                                   keyLeft))
-                        {
-                          curr_falling_shape->pos_c--;
-                        }
-                    }
-                  else if (ev_buf[i].Event.KeyEvent.wVirtualKeyCode
-                           == keyRight)
-                    {
-                      if (curr_falling_shape->pos_c < COLUMN - 1
-                          && shape_boundary_check (curr_falling_shape,
-                                                   keyRight))
-                        {
-                          curr_falling_shape->pos_c++;
-                        }
-                    }
-                  else if (ev_buf[i].Event.KeyEvent.wVirtualKeyCode == keyDown)
-                    {
-                      if (curr_falling_shape->pos_r < ROW - 1
-                          && shape_boundary_check (curr_falling_shape,
-                                                   keyDown))
-                        {
-                          curr_falling_shape->pos_r++;
-                        }
-                    }
-                  else if (ev_buf[i].Event.KeyEvent.wVirtualKeyCode
-                           == VK_ESCAPE)
-                    {
-                      GAMEOVER = 1;
-                    }
-                  else if (ev_buf[i].Event.KeyEvent.wVirtualKeyCode
-                           == keyShift)
-                    {
-                      if (shape_boundary_check (curr_falling_shape, keyShift))
-                        {
-                          switch (curr_falling_shape->type)
-                            {
-                            case SHAPE_VLINE:
-                              curr_falling_shape->type = SHAPE_HLINE;
-                              break;
-                            case SHAPE_HLINE:
-                              curr_falling_shape->type = SHAPE_VLINE;
-                              break;
-                            case SHAPE_L_WITHLONGHLINE:
-                              curr_falling_shape->type = SHAPE_L_WITHLONGVLINE;
-                              break;
-                            case SHAPE_L_WITHLONGVLINE:
-                              curr_falling_shape->type = SHAPE_L_WITHLONGHLINE;
-                              break;
-                            case SHAPE_T_VERTICAL:
-                              curr_falling_shape->type
-                                  = SHAPE_T_HORIZONTAL_MIRROR;
-                              break;
-                            case SHAPE_T_HORIZONTAL_MIRROR:
-                              curr_falling_shape->type = SHAPE_T_MIRROR;
-                              break;
-                            case SHAPE_T_MIRROR:
-                              curr_falling_shape->type = SHAPE_T_HORIZONTAL;
-                              break;
-                            case SHAPE_T_HORIZONTAL:
-                              curr_falling_shape->type = SHAPE_T_VERTICAL;
-                              break;
-                            default:
-                              break;
-                            }
-                        }
-                    }
+                  if (ev_buf[i].Event.KeyEvent.bKeyDown)
+                    continue; /* game loop is behind, drop the press */
+
+                  while (tail - keyq_head == KEYQ_SIZE && !GAMEOVER)
+                    Sleep (0);
                 }
+
+              key_event *e = &KEYQ[tail % KEYQ_SIZE];
+              e->key = ev_buf[i].Event.KeyEvent.wVirtualKeyCode;
+              e->down = ev_buf[i].Event.KeyEvent.bKeyDown;
+              e->t = t;
+
+              InterlockedExchange (&keyq_tail, tail + 1);
             }
+
+          SetEvent (keyq_ready);
         }
     }
 
   return 0;
 }
 
-void
-add_shape (shape s)
+static shape *
+falling_shape (void)
 {
-  SHAPES[shape_count++] = s;
+  if (curr_falling_shape != NULL && curr_falling_shape->is_falling)
+    ;
+  else
+    for (int i = shape_count - 1; i >= 0; i--)
+      {
+        if (SHAPES[i].is_falling)
+          curr_falling_shape = &SHAPES[i];
+      }
+
+  return curr_falling_shape;
 }
 
-int
-bounded_shapeidx (int r, int c)
+static int
+move_shape (int key)
 {
-  for (size_t i = 0; i < shape_count; i++)
-    {
-      shape s = SHAPES[i];
+  if (falling_shape () == NULL)
+    return 0;
 
-      switch (s.type)
+  if (key == keyLeft)
+    {
+      if (curr_falling_shape->pos_c > 0
+          && shape_boundary_check (curr_falling_shape, keyLeft))
         {
-        case SHAPE_HLINE:
-          {
-            if (r == s.pos_r && (c >= s.pos_c && c < s.pos_c + 3))
-              {
-                return i;
-              }
-          }
-          break;
-
-        case SHAPE_VLINE:
-          {
-            if (c == s.pos_c && r >= s.pos_r && r < s.pos_r + 3)
-              {
-                return i;
-              }
-          }
-          break;
+          shape_place (curr_falling_shape, curr_falling_shape->type,
+                       curr_falling_shape->pos_r,
+                       curr_falling_shape->pos_c - 1);
+          return 1;
+        }
+    }
+  else if (key == keyRight)
+    {
+      if (curr_falling_shape->pos_c < COLUMN - 1
+          && shape_boundary_check (curr_falling_shape, keyRight))
+        {
+          shape_place (curr_falling_shape, curr_falling_shape->type,
+                       curr_falling_shape->pos_r,
+                       curr_falling_shape->pos_c + 1);
+          return 1;
+        }
+    }
+  else if (key == keyDown)
+    {
+      if (curr_falling_shape->pos_r < ROW - 1
+          && shape_boundary_check (curr_falling_shape, keyDown))
+        {
+          shape_place (curr_falling_shape, curr_falling_shape->type,
+                       curr_falling_shape->pos_r + 1,
+                       curr_falling_shape->pos_c);
+          return 1;
+        }
+    }
+  else if (key == keyShift)
+    {
+      if (shape_boundary_check (curr_falling_shape, keyShift))
+        {
+          int t = rotated_type (curr_falling_shape->type);
 
-        case SHAPE_L_WITHLONGHLINE:
-          {
-            if ((r == s.pos_r && c == s.pos_c)
-                || (r == s.pos_r + 1 && (c <= s.pos_c + 2 && c >= s.pos_c)))
-              {
-                return i;
-              }
-          }
-          break;
+          if (t == curr_falling_shape->type)
+            return 0;
 
-        case SHAPE_L_WITHLONGVLINE:
-          {
-            if (((r == s.pos_r + 2) && (c == s.pos_c + 1))
-                || ((r >= s.pos_r) && (r < s.pos_r + 3) && (c == s.pos_c)))
-              {
-                return i;
-              }
-          }
-          break;
+          shape_place (curr_falling_shape, t, curr_falling_shape->pos_r,
+                       curr_falling_shape->pos_c);
+          return 1;
+        }
+    }
+
+  return 0;
+}
+
+static int
+held_index (int key)
+{
+  if (key == keyLeft)
+    return HELD_LEFT;
+  else if (key == keyRight)
+    return HELD_RIGHT;
+  else if (key == keyDown)
+    return HELD_DOWN;
+  else if (key == keyUndo)
+    return HELD_UNDO;
+
+  return -1;
+}
+
+static int
+held_key (int idx)
+{
+  switch (idx)
+    {
+    case HELD_LEFT:
+      return keyLeft;
+    case HELD_RIGHT:
+      return keyRight;
+    case HELD_UNDO:
+      return keyUndo;
+    default:
+      return keyDown;
+    }
+}
+
+// Held undo steps back one tick per repeat, other keys move the shape
+static int
+apply_key (int key)
+{
+  if (key == keyUndo)
+    return history_rewind (1) != 0;
+
+  return move_shape (key);
+}
+
+/*
+  Replays queued key events and auto-repeats up to time `until`, in
+  timestamp order. Console auto-repeat is ignored; a held key moves once
+  on press, again after `dasDelay` and then every `arrRate` ms, except
+  rotation, which only happens once per press.
+  Returns non-zero if the falling shape changed.
+*/
+static int
+input_advance (LONGLONG until)
+{
+  int changed = 0;
+
+  while (1)
+    {
+      key_event *e = NULL;
+      int r = -1;
+
+      if (keyq_head != keyq_tail && KEYQ[keyq_head % KEYQ_SIZE].t <= until)
+        e = &KEYQ[keyq_head % KEYQ_SIZE];
+
+      for (int i = 0; i < TOTAL_HELD; i++)
+        {
+          if (HELD[i].held && HELD[i].next_repeat <= until
+              && (r == -1 || HELD[i].next_repeat < HELD[r].next_repeat))
+            r = i;
+        }
+
+      if (e != NULL && (r == -1 || e->t <= HELD[r].next_repeat))
+        {
+          int k = held_index (e->key);
+          int pressed = 0;
+
+          if (k != -1)
+            {
+              if (e->down && !HELD[k].held)
+                {
+                  HELD[k].held = 1;
+                  HELD[k].next_repeat = e->t + dasDelay * 1000LL;
+                  changed |= apply_key (e->key);
+                  pressed = 1;
+                }
+              else if (!e->down)
+                HELD[k].held = 0;
+            }
+          else if (e->down && e->key == VK_ESCAPE)
+            GAMEOVER = 1;
+          else if (e->key == keyShift)
+            {
+              /* console auto-repeat sends more downs while it is held */
+              if (e->down && !shift_held)
+                {
+                  changed |= move_shape (e->key);
+                  pressed = 1;
+                }
+
+              shift_held = e->down;
+            }
+
+          KEYS_APPLIED += pressed;
+
+          /* redraw so the counter shows up even if nothing moved */
+          if (pressed && showKeys)
+            changed = 1;
+
+          InterlockedExchange (&keyq_head, keyq_head + 1);
+        }
+      else if (r != -1)
+        {
+          if (arrRate > 0)
+            {
+              changed |= apply_key (held_key (r));
+              HELD[r].next_repeat += arrRate * 1000LL;
+            }
+          else
+            {
+              /* instant repeat: slide as far as it goes, retry next ms */
+              while (apply_key (held_key (r)))
+                changed = 1;
+              HELD[r].next_repeat += 1000LL;
+            }
+        }
+      else
+        break;
+    }
+
+  return changed;
+}
+
+// Earliest of `until` and the next auto-repeat of a held key
+static LONGLONG
+input_deadline (LONGLONG until)
+{
+  for (int i = 0; i < TOTAL_HELD; i++)
+    {
+      if (HELD[i].held && HELD[i].next_repeat < until)
+        until = HELD[i].next_repeat;
+    }
+
+  return until;
+}
+
+static void
+history_pack_row (int r, unsigned char *out)
+{
+  memset (out, 0, hist_row_bytes);
+
+  for (int c = 0; c < COLUMN; c++)
+    {
+      if (SCREEN_AT (r, c))
+        out[c / 8] |= 1 << (c % 8);
+    }
+}
+
+static void
+history_unpack_row (int r, const unsigned char *in)
+{
+  for (int c = 0; c < COLUMN; c++)
+    SCREEN_AT (r, c) = (in[c / 8] >> (c % 8)) & 1;
+}
+
+static unsigned char *
+history_row_slot (size_t tick, int k)
+{
+  return HIST_ROWS
+         + ((tick % HISTORY_TICKS) * MAX_ROW_DELTA + k) * hist_row_bytes;
+}
+
+/*
+  Brings hist_board up to date with SCREEN, recording the changed rows in
+  `h`. Returns 1 if more than MAX_ROW_DELTA rows changed.
+*/
+static int
+history_diff_rows (history_tick *h)
+{
+  int overflow = 0;
+
+  h->rows_n = 0;
+
+  for (int r = 0; r < ROW; r++)
+    {
+      unsigned char *prev = hist_board + r * hist_row_bytes;
+
+      history_pack_row (r, hist_row);
+
+      if (!memcmp (hist_row, prev, hist_row_bytes))
+        continue;
+
+      memcpy (prev, hist_row, hist_row_bytes);
+
+      if (h->rows_n == MAX_ROW_DELTA)
+        overflow = 1;
+      else
+        {
+          memcpy (history_row_slot (h->tick, h->rows_n), hist_row,
+                  hist_row_bytes);
+          h->rows[h->rows_n++] = r;
+        }
+    }
+
+  return overflow;
+}
+
+static void
+history_keyframe_take (history_tick *h)
+{
+  history_keyframe *k = &KEYFRAMES[kf_next];
+
+  k->tick = hist_tick;
+  k->shape_count = shape_count;
+  k->score = SCORE;
+  k->pieces = PIECES;
+  k->ticks = TICKS;
+  k->lines = LINES;
+  k->retired_rows = RETIRED_ROWS;
+  k->retired_cells = RETIRED_CELLS;
+  memcpy (k->shapes, SHAPES, shape_count * sizeof (shape));
+  memcpy (KF_BOARDS + kf_next * ROW * hist_row_bytes, hist_board,
+          ROW * hist_row_bytes);
+
+  h->kf_tick = hist_tick;
+  h->kf_slot = kf_next;
+  h->n = 0;
+  h->rows_n = 0;
+
+  kf_next = (kf_next + 1) % KEYFRAME_SLOTS;
+}
+
+// Call once per tick, after the tick's moves have been applied
+static void
+history_record (void)
+{
+  if (hist_empty)
+    hist_empty = 0;
+  else
+    hist_tick++;
+
+  history_tick *h = &HISTORY[hist_tick % HISTORY_TICKS];
+  history_tick *p = &HISTORY[(hist_tick - 1) % HISTORY_TICKS];
+
+  h->tick = hist_tick;
+  h->shape_count = shape_count;
+  h->score = SCORE;
+  h->pieces = PIECES;
+  h->ticks = TICKS;
+  h->lines = LINES;
+  h->retired_rows = RETIRED_ROWS;
+  h->retired_cells = RETIRED_CELLS;
+  h->n = 0;
+  h->rows_n = 0;
+
+  int need_kf = hist_tick == hist_first
+                || hist_tick - p->kf_tick >= KEYFRAME_EVERY;
+
+  if (!need_kf)
+    {
+      h->kf_tick = p->kf_tick;
+      h->kf_slot = p->kf_slot;
+
+      for (size_t i = 0; i < shape_count; i++)
+        {
+          if (i < hist_prev_count
+              && !memcmp (&SHAPES[i], &hist_prev[i], sizeof (shape)))
+            continue;
+
+          if (h->n == MAX_TICK_DELTA)
+            {
+              need_kf = 1;
+              break;
+            }
+
+          h->d[h->n].idx = i;
+          h->d[h->n].s = SHAPES[i];
+          h->n++;
+        }
+    }
+
+  /* always diffed, so hist_board is current for the keyframe */
+  if (hist_row_bytes && history_diff_rows (h))
+    need_kf = 1;
+
+  if (need_kf)
+    history_keyframe_take (h);
+
+  if (hist_tick - hist_first >= HISTORY_TICKS)
+    hist_first = hist_tick - HISTORY_TICKS + 1;
+
+  memcpy (hist_prev, SHAPES, shape_count * sizeof (shape));
+  hist_prev_count = shape_count;
+}
+
+/*
+  Restores the game to the end of `tick` and drops any history after it.
+  Returns 0 if `tick` is no longer (or not yet) in the buffer.
+*/
+static int
+history_seek (size_t tick)
+{
+  if (hist_empty || tick > hist_tick || tick < hist_first)
+    return 0;
+
+  history_tick *h = &HISTORY[tick % HISTORY_TICKS];
+  history_keyframe *k = &KEYFRAMES[h->kf_slot];
+
+  /* keyframe was overwritten by forced ones, treat as out of range */
+  if (h->tick != tick || k->tick != h->kf_tick)
+    return 0;
+
+  memcpy (SHAPES, k->shapes, k->shape_count * sizeof (shape));
+  memcpy (hist_board, KF_BOARDS + h->kf_slot * ROW * hist_row_bytes,
+          ROW * hist_row_bytes);
+
+  for (size_t t = k->tick + 1; t <= tick; t++)
+    {
+      history_tick *d = &HISTORY[t % HISTORY_TICKS];
+
+      for (unsigned char i = 0; i < d->n; i++)
+        SHAPES[d->d[i].idx] = d->d[i].s;
+
+      for (unsigned char i = 0; i < d->rows_n; i++)
+        memcpy (hist_board + d->rows[i] * hist_row_bytes,
+                history_row_slot (t, i), hist_row_bytes);
+    }
+
+  if (hist_row_bytes)
+    {
+      for (int r = 0; r < ROW; r++)
+        history_unpack_row (r, hist_board + r * hist_row_bytes);
+    }
+
+  shape_count = h->shape_count;
+  shape_cover_rebuild ();
+  SCORE = h->score;
+  PIECES = h->pieces;
+  TICKS = h->ticks;
+  LINES = h->lines;
+  RETIRED_ROWS = h->retired_rows;
+  RETIRED_CELLS = h->retired_cells;
+  curr_falling_shape = NULL;
+
+  memcpy (hist_prev, SHAPES, shape_count * sizeof (shape));
+  hist_prev_count = shape_count;
+  hist_tick = tick;
+
+  return 1;
+}
+
+// Steps back up to `n` ticks, returns how many were actually rewound
+static size_t
+history_rewind (size_t n)
+{
+  if (hist_empty)
+    return 0;
+
+  size_t from = hist_tick;
+  size_t target = hist_tick - hist_first < n ? hist_first : hist_tick - n;
+
+  /* skip ticks whose keyframe has been recycled */
+  while (target < from && !history_seek (target))
+    target++;
+
+  if (target == from)
+    return 0;
+
+  memset (HELD, 0, sizeof (HELD[0]) * HELD_UNDO); /* keep undo held */
+  return from - target;
+}
+
+static void
+reset_game (void)
+{
+  shape_count = 0;
+  shape_cover_rebuild ();
+  SCORE = 0;
+  GAMEOVER = 0;
+  PIECES = 1;
+  TICKS = 0;
+  LINES = 0;
+
+  // add a test shape
+  add_shape ((shape){
+      .pos_c = 1,
+      .pos_r = 1,
+      .type = SHAPE_HLINE,
+      .is_falling = 1,
+  });
+  curr_falling_shape = SHAPES;
+  next_shape_type = rand_range (0, TOTAL_SHAPES);
+}
+#endif
+
+static int
+rotated_type (int type)
+{
+  switch (type)
+    {
+    case SHAPE_VLINE:
+      return SHAPE_HLINE;
+    case SHAPE_HLINE:
+      return SHAPE_VLINE;
+    case SHAPE_L_WITHLONGHLINE:
+      return SHAPE_L_WITHLONGVLINE;
+    case SHAPE_L_WITHLONGVLINE:
+      return SHAPE_L_WITHLONGHLINE;
+    case SHAPE_T_VERTICAL:
+      return SHAPE_T_HORIZONTAL_MIRROR;
+    case SHAPE_T_HORIZONTAL_MIRROR:
+      return SHAPE_T_MIRROR;
+    case SHAPE_T_MIRROR:
+      return SHAPE_T_HORIZONTAL;
+    case SHAPE_T_HORIZONTAL:
+      return SHAPE_T_VERTICAL;
+    default:
+      return type;
+    }
+}
+
+// Points awarded when a shape of `type` spawns
+static size_t
+shape_score (int type)
+{
+  switch (type)
+    {
+    case SHAPE_HLINE:
+    case SHAPE_VLINE:
+      return 3;
+
+    case SHAPE_L_WITHLONGHLINE:
+    case SHAPE_L_WITHLONGVLINE:
+      return 4;
+
+    case SHAPE_T_HORIZONTAL:
+    case SHAPE_T_VERTICAL:
+    case SHAPE_T_MIRROR:
+    case SHAPE_T_HORIZONTAL_MIRROR:
+      return 5;
+
+    default:
+      return 0;
+    }
+}
+
+#ifndef TETRIS_NO_MAIN
+static void
+add_shape (shape s)
+{
+  SHAPES[shape_count++] = s;
+  shape_cover (&SHAPES[shape_count - 1], 1);
+}
+
+// Adds `d` to the cover counts of every cell of `s`
+static void
+shape_cover (const shape *s, int d)
+{
+  for (int j = 0; j < SHAPE_CELL_COUNT[s->type]; j++)
+    {
+      int r = s->pos_r + SHAPE_CELLS[s->type][j][0];
+      int c = s->pos_c + SHAPE_CELLS[s->type][j][1];
+
+      if (r < 0 || r >= ROW || c < 0 || c >= COLUMN)
+        {
+          SHAPES_OUTSIDE += d;
+          continue;
+        }
+
+      unsigned char n = SHAPE_COVER[r * COLUMN + c] += d;
+
+      if (c < 64)
+        SHAPE_ROWS[r] = n ? SHAPE_ROWS[r] | 1ULL << c
+                          : SHAPE_ROWS[r] & ~(1ULL << c);
+    }
+}
+
+// Recounts the cover from SHAPES[], after it was replaced wholesale
+static void
+shape_cover_rebuild (void)
+{
+  memset (SHAPE_COVER, 0, ROW * COLUMN);
+  memset (SHAPE_ROWS, 0, ROW * sizeof (SHAPE_ROWS[0]));
+  SHAPES_OUTSIDE = 0;
+
+  for (size_t i = 0; i < shape_count; i++)
+    shape_cover (&SHAPES[i], 1);
+}
+
+static void
+shape_place (shape *s, int type, int r, int c)
+{
+  shape_cover (s, -1);
+  s->type = type;
+  s->pos_r = r;
+  s->pos_c = c;
+  shape_cover (s, 1);
+}
+
+/*
+  Returns -1 if nothing covers (r, c), LOCKED_CELL for a cell landed on
+  SCREEN, SHAPE_CELL for a shape on the board, or the index of the shape
+  covering an off-board cell.
+*/
+static int
+bounded_shapeidx (int r, int c)
+{
+  if (r >= 0 && r < ROW && c >= 0 && c < COLUMN)
+    {
+      if (SHAPE_COVER[r * COLUMN + c])
+        return SHAPE_CELL;
+
+      /* endless and cascade keep landed shapes as cells on SCREEN */
+      return LOCKED_BOARD && SCREEN_AT (r, c) ? LOCKED_CELL : -1;
+    }
+
+  if (SHAPES_OUTSIDE == 0)
+    return -1;
+
+  for (size_t i = 0; i < shape_count; i++)
+    {
+      shape s = SHAPES[i];
+
+      switch (s.type)
+        {
+        case SHAPE_HLINE:
+          {
+            if (r == s.pos_r && (c >= s.pos_c && c < s.pos_c + 3))
+              {
+                return i;
+              }
+          }
+          break;
+
+        case SHAPE_VLINE:
+          {
+            if (c == s.pos_c && r >= s.pos_r && r < s.pos_r + 3)
+              {
+                return i;
+              }
+          }
+          break;
+
+        case SHAPE_L_WITHLONGHLINE:
+          {
+            if ((r == s.pos_r && c == s.pos_c)
+                || (r == s.pos_r + 1 && (c <= s.pos_c + 2 && c >= s.pos_c)))
+              {
+                return i;
+              }
+          }
+          break;
+
+        case SHAPE_L_WITHLONGVLINE:
+          {
+            if (((r == s.pos_r + 2) && (c == s.pos_c + 1))
+                || ((r >= s.pos_r) && (r < s.pos_r + 3) && (c == s.pos_c)))
+              {
+                return i;
+              }
+          }
+          break;
 
         case SHAPE_T_VERTICAL:
           {
@@ -474,68 +1716,58 @@ bounded_shapeidx (int r, int c)
   return -1; /* no shape bounded */
 }
 
-void
+static void
 drop_shape (void)
 {
   int saw_falling_shape_idx = -1;
 
+  TICKS++;
+
   for (size_t i = 0; i < shape_count; i++)
     {
       shape *s = &SHAPES[i];
 
+      /* a landed shape stays landed: what it rests on never moves */
+      if (!s->is_falling)
+        continue;
+
       if (shape_boundary_check (s, keyDown))
         {
-          s->pos_r++;
+          shape_place (s, s->type, s->pos_r + 1, s->pos_c);
           saw_falling_shape_idx = 1;
         }
       else
         s->is_falling = 0;
     }
 
+  if (LOCKED_BOARD)
+    lock_landed_shapes ();
+
   if (saw_falling_shape_idx == -1)
     {
+      if (shape_count == MAX_SHAPES)
+        {
+          GAMEOVER = 1; /* out of shape slots */
+          return;
+        }
+
       // All shapes have landed, make another shape
       add_shape ((shape){
           .is_falling = 1,
           .pos_c = rand_range (0, COLUMN - 1),
           .pos_r = 1,
-          .type = rand_range (0, TOTAL_SHAPES),
+          .type = next_shape_type,
       });
+      next_shape_type = rand_range (0, TOTAL_SHAPES);
 
       shape *l = &SHAPES[shape_count - 1];
 
-      switch (l->type)
-        {
-        case SHAPE_HLINE:
-        case SHAPE_VLINE:
-          {
-            SCORE += 3;
-          }
-          break;
+      SCORE += shape_score (l->type);
+      PIECES++;
+    }
+}
 
-        case SHAPE_L_WITHLONGHLINE:
-        case SHAPE_L_WITHLONGVLINE:
-          {
-            SCORE += 4;
-          }
-          break;
-
-        case SHAPE_T_HORIZONTAL:
-        case SHAPE_T_VERTICAL:
-        case SHAPE_T_MIRROR:
-        case SHAPE_T_HORIZONTAL_MIRROR:
-          {
-            SCORE += 5;
-          }
-          break;
-
-        default:
-          break;
-        }
-    }
-}
-
-int
+static int
 shape_boundary_check (shape *s, int dir)
 {
   switch (s->type)
@@ -782,99 +2014,1806 @@ shape_boundary_check (shape *s, int dir)
     }
 }
 
-void
+static void
 clrscr (void)
 {
-  system ("cls");
+  HANDLE out = GetStdHandle (STD_OUTPUT_HANDLE);
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  COORD home = { 0, 0 };
+  DWORD n;
+
+  /* `cls` starts a shell every frame; only fall back when not a console */
+  if (!GetConsoleScreenBufferInfo (out, &info))
+    {
+      system ("cls");
+      return;
+    }
+
+  FillConsoleOutputCharacter (out, ' ', info.dwSize.X * info.dwSize.Y, home,
+                              &n);
+  FillConsoleOutputAttribute (out, info.wAttributes,
+                              info.dwSize.X * info.dwSize.Y, home, &n);
+  SetConsoleCursorPosition (out, home);
 }
 
-void
+static void
 print_screen (void)
 {
-  char topbar[(COLUMN * 2) + 1];
-  memset (topbar, '_', (COLUMN * 2));
-  topbar[(COLUMN * 2)] = '\0';
+  char *p = FRAME_BUF;
+  char *topbar = p + 1;
 
-  printf (" %s\n", topbar);
+  /* with a locked board SCREEN holds the landed cells, already cleared */
+  if (!LOCKED_BOARD)
+    build_screen ();
 
-  for (size_t i = 0; i < ROW; i++)
+  *p++ = ' ';
+  memset (p, '_', COLUMN * 2);
+  p += COLUMN * 2;
+  *p++ = '\n';
+
+  p = draw_board (p);
+
+  *p++ = ' ';
+  memcpy (p, topbar, COLUMN * 2);
+  p += COLUMN * 2;
+
+  if (showScore)
+    p += sprintf (p, "\nSCORE: %zu\n", SCORE);
+
+  if (endlessMode)
+    p += sprintf (p, "\nLINES: %zu  RETIRED: %zu rows, %zu cells\n", LINES,
+                  RETIRED_ROWS, RETIRED_CELLS);
+  else if (cascadeMode)
+    p += sprintf (p, "\nLINES: %zu\n", LINES);
+
+  FRAMES++;
+
+  /* the latency harness reads this line back from the console */
+  if (showKeys)
+    p += sprintf (p, "\nKEYS: %zu  FRAME: %zu\n", KEYS_APPLIED, FRAMES);
+
+  assert (p <= FRAME_BUF + FRAME_SIZE);
+
+  fwrite (FRAME_BUF, 1, p - FRAME_BUF, stdout);
+  fflush (stdout);
+  check_gameover ();
+}
+
+static void
+check_gameover (void)
+{
+  for (size_t i = 0; i < shape_count; i++)
     {
-      for (size_t j = 0; j < COLUMN; j++)
+      if (SHAPES[i].pos_r == 1 && !SHAPES[i].is_falling)
         {
-          int k = bounded_shapeidx (i, j);
-
-          if (k != -1)
-            SCREEN[i][j] = 1;
-          else
-            SCREEN[i][j] = 0;
+          GAMEOVER = 1;
+          return;
         }
     }
+}
+
+// Removes logical row `i` and opens an empty row at the top
+BOARD_INLINE void
+remove_row_n (size_t i, int rows, int cols)
+{
+  int *gone = SCREEN[(screen_base + i) % rows];
+
+  if (i < rows / 2)
+    {
+      /* move the rows above down */
+      for (size_t j = i; j > 0; j--)
+        SCREEN[(screen_base + j) % rows]
+            = SCREEN[(screen_base + j - 1) % rows];
+
+      SCREEN[screen_base] = gone;
+    }
+  else
+    {
+      /* move the rows below up, then rotate the freed row to the top */
+      for (size_t j = i; j < rows - 1; j++)
+        SCREEN[(screen_base + j) % rows]
+            = SCREEN[(screen_base + j + 1) % rows];
+
+      SCREEN[(screen_base + rows - 1) % rows] = gone;
+      screen_base = (screen_base + rows - 1) % rows;
+    }
 
-  char LINE[ROW][(COLUMN + 2) * 2 + 1];
-  size_t lc = 0;
+  memset (gone, 0, cols * sizeof (int));
+}
 
-  for (size_t i = 0; i < ROW; i++)
+// Retires the bottom row and opens an empty row at the top
+BOARD_INLINE void
+scroll_screen_n (int rows, int cols)
+{
+  int *bottom = SCREEN[(screen_base + rows - 1) % rows];
+
+  for (int j = 0; j < cols; j++)
+    RETIRED_CELLS += bottom[j];
+
+  RETIRED_ROWS++;
+
+  memset (bottom, 0, cols * sizeof (int));
+  screen_base = (screen_base + rows - 1) % rows;
+}
+
+static int
+cc_bottom_cmp (const void *a, const void *b)
+{
+  return CC_BOTTOM[*(const int *)b] - CC_BOTTOM[*(const int *)a];
+}
+
+static const int CC_DR[4] = { -1, 1, 0, 0 };
+static const int CC_DC[4] = { 0, 0, -1, 1 };
+
+/*
+  Floods the group holding cell `seed` into CC_CELLS from `*tail`, giving
+  each cell `label`. Once the group reaches the floor or a cell already
+  known to be held, the cells seen so far become CC_HELD and the flood
+  stops. Returns 1 if the group is held.
+*/
+BOARD_INLINE int
+cc_flood_n (int seed, int label, int *tail, int rows, int cols)
+{
+  int start = *tail;
+  int head = start;
+
+  CC_LABEL[seed] = label;
+  CC_CELLS[(*tail)++] = seed;
+
+  while (head < *tail)
     {
-      int saw_0 = 0;
+      int i = CC_CELLS[head++];
+      int r = i / cols, c = i % cols;
 
-      for (size_t j = 0; j < COLUMN; j++)
+      if (r == rows - 1)
+        goto held;
+
+      for (int k = 0; k < 4; k++)
         {
-          if (!SCREEN[i][j])
+          int nr = r + CC_DR[k], nc = c + CC_DC[k];
+          int n = nr * cols + nc;
+
+          if (nr < 0 || nc < 0 || nc >= cols || !SCREEN_AT_N (nr, nc, rows))
+            continue;
+
+          if (CC_LABEL[n] == CC_HELD)
+            goto held;
+
+          if (CC_LABEL[n] == -1)
             {
-              saw_0 = 1;
-              break;
+              CC_LABEL[n] = label;
+              CC_CELLS[(*tail)++] = n;
             }
         }
+    }
+
+  return 0;
+
+held:
+  for (int k = start; k < *tail; k++)
+    CC_LABEL[CC_CELLS[k]] = CC_HELD;
+  return 1;
+}
+
+/*
+  Whole-board flood from the floor, checked after every cascade in debug
+  builds only: a settled board has no cell that does not reach the floor
+  through its group.
+*/
+BOARD_INLINE int
+cc_grounded_n (int rows, int cols)
+{
+  int tail = 0, head = 0, filled = 0;
+
+  for (int c = 0; c < cols; c++)
+    {
+      if (SCREEN_AT_N (rows - 1, c, rows))
+        {
+          CC_LABEL[(rows - 1) * cols + c] = CC_HELD;
+          CC_CELLS[tail++] = (rows - 1) * cols + c;
+        }
+    }
+
+  while (head < tail)
+    {
+      int i = CC_CELLS[head++];
+
+      for (int k = 0; k < 4; k++)
+        {
+          int nr = i / cols + CC_DR[k], nc = i % cols + CC_DC[k];
+          int n = nr * cols + nc;
+
+          if (nr < 0 || nr >= rows || nc < 0 || nc >= cols
+              || !SCREEN_AT_N (nr, nc, rows) || CC_LABEL[n] != -1)
+            continue;
+
+          CC_LABEL[n] = CC_HELD;
+          CC_CELLS[tail++] = n;
+        }
+    }
+
+  for (int r = 0; r < rows; r++)
+    {
+      for (int c = 0; c < cols; c++)
+        filled += SCREEN_AT_N (r, c, rows);
+    }
+
+  for (int k = 0; k < tail; k++)
+    CC_LABEL[CC_CELLS[k]] = -1;
+
+  return tail == filled;
+}
+
+// Lifts group `g` off the board, drops it as far as it goes, puts it back
+BOARD_INLINE int
+cc_drop_n (int g, int rows, int cols)
+{
+  int shift = CC_SHIFT[g];
+  int *first = CC_CELLS + CC_START[g];
+  int *last = CC_CELLS + CC_END[g];
+
+  for (int *i = first; i < last; i++)
+    SCREEN_AT_N (*i / cols + shift, *i % cols, rows) = 0;
+
+  int d = 0;
+  int fits = 1;
+
+  while (fits)
+    {
+      for (int *i = first; i < last && fits; i++)
+        {
+          int r = *i / cols + shift + d + 1;
+          fits = r < rows && !SCREEN_AT_N (r, *i % cols, rows);
+        }
+
+      d += fits;
+    }
+
+  for (int *i = first; i < last; i++)
+    SCREEN_AT_N (*i / cols + shift + d, *i % cols, rows) = 1;
+
+  CC_SHIFT[g] += d;
+  return d;
+}
+
+/*
+  The `n` lines in CC_LINES were just emptied. On a settled board every
+  group reaches the floor, so only groups that touched those lines can
+  have lost their hold: they are flooded from the cells right above and
+  below each line, and those left hanging fall, lowest first. Lines this
+  completes are emptied and written back to CC_LINES; returns how many.
+*/
+BOARD_INLINE int
+cascade_settle_n (int n, int rows, int cols)
+{
+  int tail = 0;
+  int groups = 0;
 
-      if (!saw_0) // Entire line is filled
+  for (int k = 0; k < n; k++)
+    {
+      for (int r = CC_LINES[k] - 1; r <= CC_LINES[k] + 1; r += 2)
         {
-          size_t j = i;
-          while (j > 0)
+          if (r < 0 || r >= rows)
+            continue;
+
+          for (int c = 0; c < cols; c++)
             {
-              for (size_t k = 0; k < COLUMN; k++)
+              int i = r * cols + c;
+              int start = tail;
+
+              if (!SCREEN_AT_N (r, c, rows) || CC_LABEL[i] != -1
+                  || cc_flood_n (i, groups, &tail, rows, cols))
+                continue;
+
+              CC_START[groups] = start;
+              CC_END[groups] = tail;
+              CC_SHIFT[groups] = 0;
+              CC_BOTTOM[groups] = 0;
+
+              for (int j = start; j < tail; j++)
                 {
-                  SCREEN[j][k] = SCREEN[j - 1][k];
+                  if (CC_CELLS[j] / cols > CC_BOTTOM[groups])
+                    CC_BOTTOM[groups] = CC_CELLS[j] / cols;
                 }
 
-              j--;
+              CC_ORDER[groups] = groups;
+              groups++;
             }
+        }
+    }
+
+  for (int k = 0; k < tail; k++)
+    CC_LABEL[CC_CELLS[k]] = -1;
+
+  qsort (CC_ORDER, groups, sizeof (int), cc_bottom_cmp);
+
+  /*
+    Dropping lowest first settles most boards in one pass; a group that
+    was held up by one that later fell away moves on the next pass.
+  */
+  int moved = 1;
+
+  while (moved)
+    {
+      moved = 0;
+
+      for (int k = 0; k < groups; k++)
+        moved |= cc_drop_n (CC_ORDER[k], rows, cols) != 0;
+    }
+
+  /* only rows that gained cells can have been completed */
+  int top = rows, low = -1;
+
+  for (int g = 0; g < groups; g++)
+    {
+      if (CC_SHIFT[g] == 0)
+        continue;
+
+      for (int j = CC_START[g]; j < CC_END[g]; j++)
+        {
+          int r = CC_CELLS[j] / cols + CC_SHIFT[g];
+
+          if (r < top)
+            top = r;
+          if (r > low)
+            low = r;
+        }
+    }
+
+  int cleared = 0;
+
+  for (int r = top; r <= low; r++)
+    {
+      int c = 0;
+
+      while (c < cols && SCREEN_AT_N (r, c, rows))
+        c++;
+
+      if (c == cols)
+        {
+          memset (SCREEN[(screen_base + r) % rows], 0, cols * sizeof (int));
+          LINES++;
+          CC_LINES[cleared++] = r;
+        }
+    }
+
+  return cleared;
+}
+
+/*
+  Bakes shapes that stopped falling into SCREEN and clears full rows,
+  cascading in cascade mode. Endless mode then scrolls until the top
+  ENDLESS_MARGIN rows are empty.
+*/
+BOARD_INLINE void
+lock_landed_shapes_n (int rows, int cols)
+{
+  size_t kept = 0;
+  int locked = 0;
+
+  for (size_t i = 0; i < shape_count; i++)
+    {
+      shape *s = &SHAPES[i];
+
+      if (s->is_falling)
+        {
+          SHAPES[kept++] = *s;
+          continue;
+        }
+
+      for (int j = 0; j < SHAPE_CELL_COUNT[s->type]; j++)
+        {
+          int r = s->pos_r + SHAPE_CELLS[s->type][j][0];
+          int c = s->pos_c + SHAPE_CELLS[s->type][j][1];
+
+          if (r >= 0 && r < rows && c >= 0 && c < cols)
+            SCREEN_AT_N (r, c, rows) = 1;
+        }
+
+      shape_cover (s, -1);
+
+      /* same rule as check_gameover(), which no longer sees it */
+      if (s->pos_r == 1 && !endlessMode)
+        GAMEOVER = 1;
+
+      locked = 1;
+    }
+
+  if (!locked)
+    return;
+
+  shape_count = kept;
+  curr_falling_shape = NULL;
 
-          for (size_t k = 0; k < COLUMN; k++)
+  int cleared = 0;
+
+  for (int i = 0; i < rows; i++)
+    {
+      int j = 0;
+
+      while (j < cols && SCREEN_AT_N (i, j, rows))
+        j++;
+
+      if (j == cols)
+        {
+          if (cascadeMode)
             {
-              SCREEN[0][k] = 0;
+              memset (SCREEN[(screen_base + i) % rows], 0,
+                      cols * sizeof (int));
+              CC_LINES[cleared++] = i;
             }
+          else
+            remove_row_n (i, rows, cols);
+
+          LINES++;
         }
     }
 
-  for (size_t i = 0; i < ROW; i++)
+  if (cleared)
     {
-      strcpy (LINE[i], "| ");
-      for (size_t j = 0; j < COLUMN; j++)
+      /* each settle can complete more lines, which go again */
+      while (cleared)
+        cleared = cascade_settle_n (cleared, rows, cols);
+
+#ifdef _DEBUG
+      assert (cc_grounded_n (rows, cols));
+#endif
+    }
+
+  if (!endlessMode)
+    return;
+
+  for (int n = 0; n < rows; n++)
+    {
+      int busy = 0;
+
+      for (int i = 0; i < ENDLESS_MARGIN && i < rows && !busy; i++)
         {
-          if (SCREEN[i][j])
-            strcat (LINE[i], "o ");
-          else
-            strcat (LINE[i], "  ");
+          for (int j = 0; j < cols && !busy; j++)
+            busy = SCREEN_AT_N (i, j, rows);
+        }
+
+      if (!busy)
+        break;
+
+      scroll_screen_n (rows, cols);
+    }
+}
+
+/*
+  Fills SCREEN with the shapes and collapses full lines, as print_screen()
+  shows them outside endless mode.
+*/
+BOARD_INLINE void
+build_screen_n (int rows, int cols)
+{
+  for (int i = 0; i < rows; i++)
+    memset (SCREEN[i], 0, cols * sizeof (int));
+
+  for (size_t i = 0; i < shape_count; i++)
+    {
+      shape *s = &SHAPES[i];
+
+      for (int j = 0; j < SHAPE_CELL_COUNT[s->type]; j++)
+        {
+          int r = s->pos_r + SHAPE_CELLS[s->type][j][0];
+          int c = s->pos_c + SHAPE_CELLS[s->type][j][1];
+
+          if (r >= 0 && r < rows && c >= 0 && c < cols)
+            SCREEN[(screen_base + r) % rows][c] = 1;
         }
-      strcat (LINE[i], "|\n");
     }
 
-  for (size_t i = 0; i < ROW; i++)
+  for (int i = 0; i < rows; i++)
+    {
+      int *row = SCREEN[(screen_base + i) % rows];
+      int n = 0;
+
+      for (int j = 0; j < cols; j++)
+        n += row[j];
+
+      if (n == cols) // Entire line is filled
+        remove_row_n (i, rows, cols);
+    }
+}
+
+/*
+  Writes the board rows of a frame at `p` and returns the end. A locked
+  board has the falling shapes stamped over SCREEN from SHAPE_CELLS.
+*/
+BOARD_INLINE char *
+draw_board_n (char *p, int rows, int cols)
+{
+  char *first = p;
+  size_t stride = cols * 2 + 4;
+
+  for (int i = 0; i < rows; i++)
     {
-      printf (LINE[i]);
+      int *row = SCREEN[(screen_base + i) % rows];
+
+      *p++ = '|';
+      *p++ = ' ';
+
+      for (int j = 0; j < cols; j++)
+        {
+          *p++ = row[j] ? 'o' : ' ';
+          *p++ = ' ';
+        }
+
+      *p++ = '|';
+      *p++ = '\n';
     }
 
-  if (showScore)
-    printf (" %s\nSCORE: %d\n", topbar, SCORE);
-  else
-    printf (" %s", topbar);
+  if (!LOCKED_BOARD)
+    return p;
 
   for (size_t i = 0; i < shape_count; i++)
     {
-      if (SHAPES[i].pos_r == 1 && !SHAPES[i].is_falling)
+      shape *s = &SHAPES[i];
+
+      for (int j = 0; j < SHAPE_CELL_COUNT[s->type]; j++)
         {
-          GAMEOVER = 1;
-          return;
+          int r = s->pos_r + SHAPE_CELLS[s->type][j][0];
+          int c = s->pos_c + SHAPE_CELLS[s->type][j][1];
+
+          if (r >= 0 && r < rows && c >= 0 && c < cols)
+            first[r * stride + 2 + c * 2] = 'o';
         }
     }
-}
\ No newline at end of file
+
+  return p;
+}
+
+/*
+  Writes the board as the player sees it into `out`, one `row_bytes` row
+  per board row, including the full-line collapse print_screen() does.
+  The rows come straight from SHAPE_ROWS.
+*/
+BOARD_INLINE void
+pack_board_n (unsigned char *out, size_t row_bytes, int rows, int cols)
+{
+  unsigned long long full = cols == 64 ? ~0ULL : (1ULL << cols) - 1;
+  int w = rows;
+
+  /* full lines collapse: the other rows stack up from the floor */
+  for (int i = rows - 1; i >= 0; i--)
+    {
+      unsigned long long row = SHAPE_ROWS[i];
+
+      if (row == full)
+        continue;
+
+      w--;
+
+      for (size_t k = 0; k < row_bytes; k++)
+        out[w * row_bytes + k] = row >> (k * 8);
+    }
+
+  memset (out, 0, w * row_bytes);
+}
+
+#define DEFINE_BOARD_VARIANT(R, C)                                            \
+  static void build_screen_##R##x##C (void) { build_screen_n (R, C); }       \
+  static void pack_board_##R##x##C (unsigned char *out, size_t row_bytes)    \
+  {                                                                           \
+    pack_board_n (out, row_bytes, R, C);                                      \
+  }                                                                           \
+  static char *draw_board_##R##x##C (char *p)                                 \
+  {                                                                           \
+    return draw_board_n (p, R, C);                                            \
+  }                                                                           \
+  static void lock_landed_shapes_##R##x##C (void)                             \
+  {                                                                           \
+    lock_landed_shapes_n (R, C);                                              \
+  }
+
+BOARD_VARIANTS (DEFINE_BOARD_VARIANT)
+
+static void
+build_screen_any (void)
+{
+  build_screen_n (ROW, COLUMN);
+}
+
+static void
+pack_board_any (unsigned char *out, size_t row_bytes)
+{
+  pack_board_n (out, row_bytes, ROW, COLUMN);
+}
+
+static char *
+draw_board_any (char *p)
+{
+  return draw_board_n (p, ROW, COLUMN);
+}
+
+static void
+lock_landed_shapes_any (void)
+{
+  lock_landed_shapes_n (ROW, COLUMN);
+}
+
+// Picks the board loops for ROW x COLUMN; call once the options are parsed
+static void
+select_board_variant (void)
+{
+  build_screen = build_screen_any;
+  pack_board = pack_board_any;
+  draw_board = draw_board_any;
+  lock_landed_shapes = lock_landed_shapes_any;
+
+#define SELECT_BOARD_VARIANT(R, C)                                            \
+  if (ROW == R && COLUMN == C)                                                \
+    {                                                                         \
+      build_screen = build_screen_##R##x##C;                                  \
+      pack_board = pack_board_##R##x##C;                                      \
+      draw_board = draw_board_##R##x##C;                                      \
+      lock_landed_shapes = lock_landed_shapes_##R##x##C;                      \
+    }
+
+  BOARD_VARIANTS (SELECT_BOARD_VARIANT)
+#undef SELECT_BOARD_VARIANT
+}
+
+static DWORD WINAPI
+ds_write_thread (LPVOID args)
+{
+  ds_writer *w = args;
+
+  while (1)
+    {
+      WaitForSingleObject (w->ready, INFINITE);
+
+      if (w->quit)
+        break;
+
+      fwrite (w->buf[w->pending], 1, w->len[w->pending], w->f);
+      SetEvent (w->done);
+    }
+
+  return 0;
+}
+
+// Hands the current chunk to the writer and starts filling the other one
+static void
+ds_flush (ds_writer *w, size_t sample_bytes)
+{
+  size_t n = (w->len[w->cur] - 8) / sample_bytes;
+
+  if (n == 0)
+    return;
+
+  memcpy (w->buf[w->cur], &(unsigned int){ n }, 4);
+
+  assert (w->chunks < w->index_cap);
+
+  w->index[w->chunks * 2] = w->offset;
+  w->index[w->chunks * 2 + 1] = w->samples - n;
+  w->chunks++;
+  w->offset += w->len[w->cur];
+
+  WaitForSingleObject (w->done, INFINITE);
+  w->pending = w->cur;
+  SetEvent (w->ready);
+
+  w->cur ^= 1;
+  w->len[w->cur] = 8;
+  memset (w->buf[w->cur], 0, 8);
+}
+
+static int
+export_dataset (const char *path, unsigned long long count)
+{
+  /* boards are packed through a 64-bit row, from SHAPES[] only */
+  if (COLUMN > 64 || LOCKED_BOARD)
+    return 1;
+
+  const size_t row_bytes = (COLUMN + 7) / 8;
+  const size_t board_bytes = ROW * row_bytes;
+  const size_t sample_bytes = board_bytes + 12;
+
+  ds_writer w = { 0 };
+
+  select_board_variant ();
+  arena_init ();
+
+  w.f = fopen (path, "wb");
+
+  if (w.f == NULL)
+    return 1;
+
+  unsigned int header[8] = {
+    0, DS_VERSION, ROW, COLUMN, row_bytes, sample_bytes, DS_CHUNK_SAMPLES, 0,
+  };
+  memcpy (header, "CTDS", 4);
+  fwrite (header, sizeof (header), 1, w.f);
+  w.offset = sizeof (header);
+
+  for (int i = 0; i < 2; i++)
+    w.buf[i] = game_alloc (8 + DS_CHUNK_SAMPLES * sample_bytes);
+
+  /* the chunk count is known up front, so the index never grows */
+  w.index_cap = count / DS_CHUNK_SAMPLES + 1;
+  w.index = game_alloc (w.index_cap * 2 * sizeof (*w.index));
+
+  w.len[0] = 8;
+  memset (w.buf[0], 0, 8);
+  w.ready = CreateEvent (NULL, FALSE, FALSE, NULL);
+  w.done = CreateEvent (NULL, FALSE, TRUE, NULL);
+
+  HANDLE th = CreateThread (NULL, 0, ds_write_thread, &w, 0, NULL);
+  assert (th != NULL);
+
+  const int action_keys[TOTAL_ACTIONS] = {
+    [ACTION_NONE] = -1,        [ACTION_LEFT] = keyLeft,
+    [ACTION_RIGHT] = keyRight, [ACTION_DOWN] = keyDown,
+    [ACTION_SHIFT] = keyShift,
+  };
+
+  /*
+    Each episode gets its own seed, which also drives the random policy,
+    so a logged episode can be told apart from the others and replayed.
+  */
+  unsigned int seed_base = time (NULL);
+  unsigned int episode = 0;
+
+  gameSeed = seed_base;
+  srand (gameSeed);
+  reset_game ();
+
+  int logged = !results_open (resultsPath);
+
+  while (w.samples < count)
+    {
+      unsigned char *p = w.buf[w.cur] + w.len[w.cur];
+      shape *s = falling_shape ();
+
+      pack_board (p, row_bytes);
+      p += board_bytes;
+
+      *p++ = s != NULL ? s->type : 0xff;
+      *p++ = next_shape_type;
+
+      short pos[2] = { s != NULL ? s->pos_r : -1, s != NULL ? s->pos_c : -1 };
+      memcpy (p, pos, sizeof (pos));
+      p += sizeof (pos);
+
+      int action = rand () % TOTAL_ACTIONS;
+      size_t score = SCORE;
+
+      if (action != ACTION_NONE)
+        move_shape (action_keys[action]);
+
+      drop_shape ();
+      check_gameover ();
+
+      int reward = SCORE - score;
+
+      *p++ = action;
+      *p++ = GAMEOVER;
+      memcpy (p, &reward, sizeof (reward));
+
+      w.len[w.cur] += sample_bytes;
+      w.samples++;
+
+      if (w.len[w.cur] == 8 + DS_CHUNK_SAMPLES * sample_bytes)
+        ds_flush (&w, sample_bytes);
+
+      if (GAMEOVER)
+        {
+          if (logged)
+            results_append ();
+
+          gameSeed = seed_base + ++episode * 0x9e3779b9u;
+          srand (gameSeed);
+          reset_game ();
+        }
+    }
+
+  if (logged)
+    results_close ();
+
+  ds_flush (&w, sample_bytes);
+
+  WaitForSingleObject (w.done, INFINITE);
+  w.quit = 1;
+  SetEvent (w.ready);
+  WaitForSingleObject (th, INFINITE);
+  CloseHandle (th);
+  CloseHandle (w.ready);
+  CloseHandle (w.done);
+
+  unsigned long long footer[4] = { w.offset, w.chunks, w.samples, 0 };
+  memcpy (&footer[3], "CTDX", 4);
+
+  fwrite (w.index, sizeof (*w.index), w.chunks * 2, w.f);
+  fwrite (footer, sizeof (footer), 1, w.f);
+
+  int err = ferror (w.f);
+  fclose (w.f);
+
+  free (w.buf[0]);
+  free (w.buf[1]);
+  free (w.index);
+
+  return err;
+}
+#endif
+
+/*
+  Batched environments (tetris.h). Each environment keeps locked cells in
+  a bitboard and only the falling piece as a shape, so collision is a few
+  row masks ANDed against the board rather than a scan over SHAPES[].
+*/
+typedef struct
+{
+  unsigned long long row[4]; // row offsets -1..2, bit k is column offset k-1
+  int min_r, max_r, min_c, max_c;
+
+} piece_mask;
+
+static piece_mask PIECE_MASKS[TOTAL_SHAPES];
+
+/*
+  Batch state (tetris.h), kept as structure-of-arrays with one entry per
+  environment; `board` holds `rows` bit-packed rows per environment
+  without the falling piece.
+*/
+struct tetris_batch
+{
+  size_t n;
+  int rows;
+  int cols; // at most 64
+
+  unsigned long long *board;
+  int *piece_type;
+  int *piece_r;
+  int *piece_c;
+  int *next_type;
+  unsigned int *rng;
+  size_t *score;
+
+  /* step arguments, shared with the worker threads */
+  const int *actions;
+  unsigned long long *obs_out;
+  float *rewards_out;
+  unsigned char *dones_out;
+
+  /* board loops specialised for rows x cols, picked at creation */
+  void (*step_range) (struct tetris_batch *, size_t, size_t);
+
+  int threads;
+  int quit;
+  struct batch_worker *workers;
+
+};
+
+typedef struct batch_worker
+{
+  tetris_batch *b;
+  size_t from, to;
+  HANDLE start;
+  HANDLE done;
+  HANDLE thread;
+
+} batch_worker;
+
+static void
+init_piece_masks (void)
+{
+  for (int t = 0; t < TOTAL_SHAPES; t++)
+    {
+      piece_mask *m = &PIECE_MASKS[t];
+      memset (m, 0, sizeof (*m));
+
+      for (int j = 0; j < SHAPE_CELL_COUNT[t]; j++)
+        {
+          int dr = SHAPE_CELLS[t][j][0];
+          int dc = SHAPE_CELLS[t][j][1];
+
+          m->row[dr + 1] |= 1ULL << (dc + 1);
+
+          if (dr < m->min_r)
+            m->min_r = dr;
+          if (dr > m->max_r)
+            m->max_r = dr;
+          if (dc < m->min_c)
+            m->min_c = dc;
+          if (dc > m->max_c)
+            m->max_c = dc;
+        }
+    }
+}
+
+static unsigned int
+batch_rand (unsigned int *state)
+{
+  /* xorshift32, one stream per environment */
+  unsigned int x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static void
+batch_reset_one (tetris_batch *b, size_t e)
+{
+  memset (b->board + e * b->rows, 0, b->rows * sizeof (*b->board));
+
+  /* reset_game()'s first piece, moved in off the wall on narrow boards */
+  int hi = b->cols - 1 - PIECE_MASKS[SHAPE_HLINE].max_c;
+
+  b->piece_type[e] = SHAPE_HLINE;
+  b->piece_r[e] = 1;
+  b->piece_c[e] = hi < 1 ? hi : 1;
+  b->next_type[e] = batch_rand (&b->rng[e]) % TOTAL_SHAPES;
+  b->score[e] = 0;
+}
+
+BOARD_INLINE unsigned long long
+piece_row (int type, int dr, int c)
+{
+  unsigned long long m = PIECE_MASKS[type].row[dr + 1];
+  return c > 0 ? m << (c - 1) : m >> 1;
+}
+
+BOARD_INLINE int
+batch_collides (tetris_batch *b, size_t e, int type, int r, int c,
+                int rows, int cols)
+{
+  piece_mask *m = &PIECE_MASKS[type];
+  unsigned long long *board = b->board + e * rows;
+
+  if (c + m->min_c < 0 || c + m->max_c >= cols || r + m->max_r >= rows)
+    return 1;
+
+  for (int dr = m->min_r; dr <= m->max_r; dr++)
+    {
+      if (r + dr >= 0 && (board[r + dr] & piece_row (type, dr, c)))
+        return 1;
+    }
+
+  return 0;
+}
+
+// Spawns the next piece, returns the points it scores or -1 if blocked
+BOARD_INLINE int
+batch_spawn (tetris_batch *b, size_t e, int rows, int cols)
+{
+  int t = b->next_type[e];
+  int lo = -PIECE_MASKS[t].min_c;
+  int hi = cols - 1 - PIECE_MASKS[t].max_c;
+  int c = lo + batch_rand (&b->rng[e]) % (hi - lo + 1);
+
+  b->next_type[e] = batch_rand (&b->rng[e]) % TOTAL_SHAPES;
+
+  if (batch_collides (b, e, t, 1, c, rows, cols))
+    return -1;
+
+  b->piece_type[e] = t;
+  b->piece_r[e] = 1;
+  b->piece_c[e] = c;
+
+  return shape_score (t);
+}
+
+BOARD_INLINE void
+batch_observe (tetris_batch *b, size_t e, unsigned long long *obs, int rows)
+{
+  int t = b->piece_type[e];
+  int r = b->piece_r[e];
+
+  memcpy (obs, b->board + e * rows, rows * sizeof (*obs));
+
+  for (int dr = PIECE_MASKS[t].min_r; dr <= PIECE_MASKS[t].max_r; dr++)
+    {
+      if (r + dr >= 0)
+        obs[r + dr] |= piece_row (t, dr, b->piece_c[e]);
+    }
+}
+
+// Locks the falling piece, clears full rows; returns 1 if the game is over
+BOARD_INLINE int
+batch_lock (tetris_batch *b, size_t e, int rows, int cols)
+{
+  unsigned long long *board = b->board + e * rows;
+  unsigned long long full = cols == 64 ? ~0ULL : (1ULL << cols) - 1;
+  int t = b->piece_type[e];
+  int r = b->piece_r[e];
+
+  for (int dr = PIECE_MASKS[t].min_r; dr <= PIECE_MASKS[t].max_r; dr++)
+    {
+      if (r + dr >= 0)
+        board[r + dr] |= piece_row (t, dr, b->piece_c[e]);
+    }
+
+  /* same rule as check_gameover() */
+  if (r == 1)
+    return 1;
+
+  int w = rows - 1;
+
+  for (int i = rows - 1; i >= 0; i--)
+    {
+      if (board[i] != full)
+        board[w--] = board[i];
+    }
+
+  while (w >= 0)
+    board[w--] = 0;
+
+  return 0;
+}
+
+BOARD_INLINE void
+batch_step_range_n (tetris_batch *b, size_t from, size_t to, int rows,
+                    int cols)
+{
+  for (size_t e = from; e < to; e++)
+    {
+      int t = b->piece_type[e];
+      int r = b->piece_r[e];
+      int c = b->piece_c[e];
+      int reward = 0;
+      int done = 0;
+
+      switch (b->actions[e])
+        {
+        case ACTION_LEFT:
+          if (!batch_collides (b, e, t, r, c - 1, rows, cols))
+            c--;
+          break;
+        case ACTION_RIGHT:
+          if (!batch_collides (b, e, t, r, c + 1, rows, cols))
+            c++;
+          break;
+        case ACTION_DOWN:
+          if (!batch_collides (b, e, t, r + 1, c, rows, cols))
+            r++;
+          break;
+        case ACTION_SHIFT:
+          if (!batch_collides (b, e, rotated_type (t), r, c, rows, cols))
+            t = rotated_type (t);
+          break;
+        default:
+          break;
+        }
+
+      b->piece_type[e] = t;
+      b->piece_c[e] = c;
+
+      if (!batch_collides (b, e, t, r + 1, c, rows, cols))
+        b->piece_r[e] = r + 1;
+      else
+        {
+          b->piece_r[e] = r;
+          done = batch_lock (b, e, rows, cols);
+
+          if (!done)
+            {
+              reward = batch_spawn (b, e, rows, cols);
+              done = reward < 0;
+              reward = reward < 0 ? 0 : reward;
+            }
+        }
+
+      b->score[e] += reward;
+
+      if (done)
+        batch_reset_one (b, e);
+
+      b->rewards_out[e] = reward;
+      b->dones_out[e] = done;
+      batch_observe (b, e, b->obs_out + e * rows, rows);
+    }
+}
+
+#define DEFINE_BATCH_VARIANT(R, C)                                            \
+  static void batch_step_range_##R##x##C (tetris_batch *b, size_t from,      \
+                                           size_t to)                        \
+  {                                                                           \
+    batch_step_range_n (b, from, to, R, C);                                   \
+  }
+
+BOARD_VARIANTS (DEFINE_BATCH_VARIANT)
+
+static void
+batch_step_range_any (tetris_batch *b, size_t from, size_t to)
+{
+  batch_step_range_n (b, from, to, b->rows, b->cols);
+}
+
+static DWORD WINAPI
+batch_worker_thread (LPVOID args)
+{
+  batch_worker *w = args;
+
+  while (1)
+    {
+      WaitForSingleObject (w->start, INFINITE);
+
+      if (w->b->quit)
+        break;
+
+      w->b->step_range (w->b, w->from, w->to);
+      SetEvent (w->done);
+    }
+
+  return 0;
+}
+
+tetris_batch *
+tetris_batch_new (size_t n, int rows, int cols, unsigned int seed,
+                  int threads)
+{
+  if (n == 0 || rows < 4 || cols < 3 || cols > 64)
+    return NULL;
+
+  /* WaitForMultipleObjects() takes at most 64 handles */
+  if (threads < 1)
+    threads = 1;
+  if (threads > 64)
+    threads = 64;
+  if ((size_t)threads > n)
+    threads = n;
+
+  init_piece_masks ();
+
+  tetris_batch *b = calloc (1, sizeof (*b));
+
+  if (b == NULL)
+    return NULL;
+
+  b->n = n;
+  b->rows = rows;
+  b->cols = cols;
+  b->board = malloc (n * rows * sizeof (*b->board));
+  b->piece_type = malloc (n * sizeof (int));
+  b->piece_r = malloc (n * sizeof (int));
+  b->piece_c = malloc (n * sizeof (int));
+  b->next_type = malloc (n * sizeof (int));
+  b->rng = malloc (n * sizeof (unsigned int));
+  b->score = malloc (n * sizeof (size_t));
+  b->threads = 1; // workers started so far, for tetris_batch_free()
+  b->step_range = batch_step_range_any;
+
+  if (b->board == NULL || b->piece_type == NULL || b->piece_r == NULL
+      || b->piece_c == NULL || b->next_type == NULL || b->rng == NULL
+      || b->score == NULL)
+    {
+      tetris_batch_free (b);
+      return NULL;
+    }
+
+#define SELECT_BATCH_VARIANT(R, C)                                            \
+  if (rows == R && cols == C)                                                 \
+    b->step_range = batch_step_range_##R##x##C;
+
+  BOARD_VARIANTS (SELECT_BATCH_VARIANT)
+#undef SELECT_BATCH_VARIANT
+
+  for (size_t e = 0; e < n; e++)
+    {
+      /* xorshift must not start at 0 */
+      b->rng[e] = (seed + e) * 2654435761u | 1;
+      batch_reset_one (b, e);
+    }
+
+  if (threads > 1)
+    {
+      b->workers = calloc (threads, sizeof (batch_worker));
+
+      if (b->workers == NULL)
+        {
+          tetris_batch_free (b);
+          return NULL;
+        }
+
+      for (int i = 0; i < threads; i++)
+        {
+          batch_worker *w = &b->workers[i];
+
+          w->b = b;
+          w->from = n * i / threads;
+          w->to = n * (i + 1) / threads;
+
+          /* slice 0 runs on the calling thread */
+          if (i == 0)
+            continue;
+
+          w->start = CreateEvent (NULL, FALSE, FALSE, NULL);
+          w->done = CreateEvent (NULL, FALSE, FALSE, NULL);
+
+          if (w->start != NULL && w->done != NULL)
+            w->thread
+                = CreateThread (NULL, 0, batch_worker_thread, w, 0, NULL);
+
+          if (w->thread == NULL)
+            {
+              if (w->start != NULL)
+                CloseHandle (w->start);
+              if (w->done != NULL)
+                CloseHandle (w->done);
+
+              tetris_batch_free (b);
+              return NULL;
+            }
+
+          b->threads = i + 1;
+        }
+    }
+
+  return b;
+}
+
+void
+tetris_batch_free (tetris_batch *b)
+{
+  if (b == NULL)
+    return;
+
+  if (b->workers != NULL)
+    {
+      b->quit = 1;
+
+      for (int i = 1; i < b->threads; i++)
+        {
+          SetEvent (b->workers[i].start);
+          WaitForSingleObject (b->workers[i].thread, INFINITE);
+          CloseHandle (b->workers[i].thread);
+          CloseHandle (b->workers[i].start);
+          CloseHandle (b->workers[i].done);
+        }
+
+      free (b->workers);
+    }
+
+  free (b->board);
+  free (b->piece_type);
+  free (b->piece_r);
+  free (b->piece_c);
+  free (b->next_type);
+  free (b->rng);
+  free (b->score);
+  free (b);
+}
+
+void
+tetris_batch_reset (tetris_batch *b, unsigned long long *obs_out)
+{
+  for (size_t e = 0; e < b->n; e++)
+    {
+      batch_reset_one (b, e);
+
+      if (obs_out != NULL)
+        batch_observe (b, e, obs_out + e * b->rows, b->rows);
+    }
+}
+
+void
+tetris_batch_step (tetris_batch *b, const int *actions,
+                   unsigned long long *obs_out, float *rewards_out,
+                   unsigned char *dones_out)
+{
+  b->actions = actions;
+  b->obs_out = obs_out;
+  b->rewards_out = rewards_out;
+  b->dones_out = dones_out;
+
+  if (b->workers == NULL)
+    {
+      b->step_range (b, 0, b->n);
+      return;
+    }
+
+  HANDLE done[64];
+
+  for (int i = 1; i < b->threads; i++)
+    {
+      done[i - 1] = b->workers[i].done;
+      SetEvent (b->workers[i].start);
+    }
+
+  b->step_range (b, b->workers[0].from, b->workers[0].to);
+  WaitForMultipleObjects (b->threads - 1, done, TRUE, INFINITE);
+}
+
+#ifndef TETRIS_NO_MAIN
+static unsigned long long
+fnv1a (const void *p, size_t n, unsigned long long h)
+{
+  const unsigned char *b = p;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      h ^= b[i];
+      h *= 0x100000001b3ULL;
+    }
+
+  return h;
+}
+
+// Identifies the options that change how a game plays
+static unsigned long long
+config_hash (void)
+{
+  int cfg[] = { ROW, COLUMN, endlessMode, dasDelay, arrRate, cascadeMode };
+
+  return fnv1a (cfg, sizeof (cfg), 0xcbf29ce484222325ULL);
+}
+
+static unsigned int
+result_checksum (const result_record *r)
+{
+  return fnv1a (&r->seed, sizeof (*r) - offsetof (result_record, seed),
+                0xcbf29ce484222325ULL);
+}
+
+static int
+results_open (const char *path)
+{
+  /* without FILE_WRITE_DATA every WriteFile() is an atomic append */
+  RESULTS = CreateFileA (path, FILE_APPEND_DATA,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+  if (RESULTS == INVALID_HANDLE_VALUE)
+    return 1;
+
+  /* pad a record torn by a crash; readers skip it like any bad record */
+  LARGE_INTEGER size;
+  DWORD n;
+
+  if (GetFileSizeEx (RESULTS, &size)
+      && size.QuadPart % sizeof (result_record) != 0)
+    {
+      static const result_record pad;
+
+      WriteFile (RESULTS, &pad,
+                 sizeof (pad) - size.QuadPart % sizeof (result_record), &n,
+                 NULL);
+    }
+
+  return 0;
+}
+
+// Logs the game that just ended; results_close() writes out the last batch
+static void
+results_append (void)
+{
+  result_record r = {
+    .magic = RESULT_MAGIC,
+    .seed = gameSeed,
+    .score = SCORE,
+    .lines = LINES,
+    .pieces = PIECES,
+    .duration_ms = TICKS * TICK_US / 1000,
+    .config_hash = config_hash (),
+  };
+  r.checksum = result_checksum (&r);
+
+  RESULTS_PENDING[results_pending++] = r;
+
+  if (results_pending == RESULTS_BATCH)
+    results_flush ();
+}
+
+// Appends the batched records in one write
+static void
+results_flush (void)
+{
+  DWORD n;
+
+  if (results_pending > 0)
+    WriteFile (RESULTS, RESULTS_PENDING,
+               results_pending * sizeof (result_record), &n, NULL);
+  results_pending = 0;
+}
+
+static void
+results_close (void)
+{
+  results_flush ();
+  FlushFileBuffers (RESULTS);
+  CloseHandle (RESULTS);
+  RESULTS = INVALID_HANDLE_VALUE;
+}
+
+static int
+result_entry_cmp (const void *a, const void *b)
+{
+  const result_entry *x = a, *y = b;
+
+  if (x->config_hash != y->config_hash)
+    return x->config_hash < y->config_hash ? -1 : 1;
+  if (x->score != y->score)
+    return x->score < y->score ? -1 : 1;
+  if (x->record != y->record)
+    return x->record < y->record ? -1 : 1;
+
+  return 0;
+}
+
+/*
+  Reads the run headers of the index; stops at the first run that is torn
+  or does not follow on. Returns the number of runs, or -1 if `ix` is not
+  an index. `records` gets the log records covered, `end` where the last
+  good run ends.
+*/
+static int
+index_load_runs (FILE *ix, result_run *runs, unsigned long long *records,
+                 long long *end)
+{
+  result_index_header h;
+
+  _fseeki64 (ix, 0, SEEK_END);
+  long long size = _ftelli64 (ix);
+  _fseeki64 (ix, 0, SEEK_SET);
+
+  *records = 0;
+  *end = sizeof (h);
+
+  if (fread (&h, sizeof (h), 1, ix) != 1 || h.magic != RESULT_INDEX_MAGIC
+      || h.version != RESULT_INDEX_VERSION)
+    return -1;
+
+  int n = 0;
+
+  while (n < MAX_RESULT_RUNS)
+    {
+      result_run_header rh;
+      long long at = *end;
+
+      _fseeki64 (ix, at, SEEK_SET);
+
+      if (fread (&rh, sizeof (rh), 1, ix) != 1 || rh.magic != RESULT_RUN_MAGIC
+          || rh.records < *records
+          || rh.count > (size - at - sizeof (rh)) / sizeof (result_entry))
+        break;
+
+      runs[n].offset = at + sizeof (rh);
+      runs[n].count = rh.count;
+      n++;
+
+      *records = rh.records;
+      *end = at + sizeof (rh) + rh.count * sizeof (result_entry);
+    }
+
+  return n;
+}
+
+/*
+  Sorts log records the index has not seen yet into a new run, merged
+  with the tail runs no bigger than it.
+*/
+static int
+results_index_update (const char *path)
+{
+  char idx_path[FILENAME_MAX];
+  snprintf (idx_path, sizeof (idx_path), "%s.idx", path);
+
+  FILE *log = fopen (path, "rb");
+
+  if (log == NULL)
+    return 1;
+
+  _fseeki64 (log, 0, SEEK_END);
+  unsigned long long n = _ftelli64 (log) / sizeof (result_record);
+
+  FILE *ix = fopen (idx_path, "r+b");
+
+  if (ix == NULL)
+    ix = fopen (idx_path, "w+b");
+
+  if (ix == NULL)
+    {
+      fclose (log);
+      return 1;
+    }
+
+  result_run runs[MAX_RESULT_RUNS];
+  unsigned long long covered;
+  long long end;
+  int nruns = index_load_runs (ix, runs, &covered, &end);
+
+  if (nruns < 0 || covered > n || nruns == MAX_RESULT_RUNS)
+    {
+      /* unreadable or from another log, rebuild it */
+      result_index_header h = {
+        .magic = RESULT_INDEX_MAGIC,
+        .version = RESULT_INDEX_VERSION,
+      };
+
+      _fseeki64 (ix, 0, SEEK_SET);
+      fwrite (&h, sizeof (h), 1, ix);
+
+      nruns = 0;
+      covered = 0;
+      end = sizeof (h);
+    }
+
+  if (covered == n && nruns > 0)
+    {
+      fclose (ix);
+      fclose (log);
+      return 0;
+    }
+
+  result_entry *fresh = malloc ((n - covered + 1) * sizeof (result_entry));
+  unsigned long long m = 0;
+
+  if (fresh == NULL)
+    {
+      fclose (ix);
+      fclose (log);
+      return 1;
+    }
+
+  _fseeki64 (log, covered * sizeof (result_record), SEEK_SET);
+
+  for (unsigned long long i = covered; i < n; i++)
+    {
+      result_record r;
+
+      if (fread (&r, sizeof (r), 1, log) != 1)
+        break;
+
+      if (r.magic != RESULT_MAGIC || r.checksum != result_checksum (&r))
+        continue;
+
+      fresh[m++] = (result_entry){ r.config_hash, r.score, i };
+    }
+
+  fclose (log);
+
+  int k = nruns;
+  unsigned long long total = m;
+
+  while (k > 0 && runs[k - 1].count <= total)
+    total += runs[--k].count;
+
+  result_entry *all = realloc (fresh, (total + 1) * sizeof (result_entry));
+
+  if (all == NULL)
+    {
+      free (fresh);
+      fclose (ix);
+      return 1;
+    }
+
+  for (int j = k; j < nruns; j++)
+    {
+      _fseeki64 (ix, runs[j].offset, SEEK_SET);
+      m += fread (all + m, sizeof (result_entry), runs[j].count, ix);
+    }
+
+  qsort (all, m, sizeof (result_entry), result_entry_cmp);
+
+  /* cut the merged runs (and any torn tail) off before writing over them */
+  long long at = end;
+
+  if (k < nruns)
+    at = runs[k].offset - sizeof (result_run_header);
+
+  fflush (ix);
+  _chsize_s (_fileno (ix), at);
+
+  result_run_header rh = {
+    .magic = RESULT_RUN_MAGIC,
+    .records = n,
+    .count = m,
+  };
+
+  _fseeki64 (ix, at, SEEK_SET);
+  fwrite (&rh, sizeof (rh), 1, ix);
+  fwrite (all, sizeof (result_entry), m, ix);
+  free (all);
+
+  int err = ferror (ix);
+  fflush (ix);
+  _commit (_fileno (ix));
+  fclose (ix);
+
+  return err;
+}
+
+static result_entry
+index_entry (FILE *ix, const result_run *run, unsigned long long i)
+{
+  result_entry e;
+
+  _fseeki64 (ix, run->offset + i * sizeof (e), SEEK_SET);
+  fread (&e, sizeof (e), 1, ix);
+
+  return e;
+}
+
+// First entry of `run` not below (cfg, score), by binary search
+static unsigned long long
+index_lower_bound (FILE *ix, const result_run *run, unsigned long long cfg,
+                   unsigned long long score)
+{
+  unsigned long long lo = 0, hi = run->count;
+  result_entry key = { cfg, score, 0 };
+
+  while (lo < hi)
+    {
+      unsigned long long mid = lo + (hi - lo) / 2;
+      result_entry e = index_entry (ix, run, mid);
+
+      if (result_entry_cmp (&e, &key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+// Entries of config `cfg` scoring below `score`, over all runs
+static unsigned long long
+index_count_below (FILE *ix, const result_run *runs, int nruns,
+                   unsigned long long cfg, unsigned long long score)
+{
+  unsigned long long n = 0;
+
+  for (int k = 0; k < nruns; k++)
+    n += index_lower_bound (ix, &runs[k], cfg, score) - runs[k].lo;
+
+  return n;
+}
+
+static int
+leaderboard (const char *path, int top)
+{
+  char idx_path[FILENAME_MAX];
+  snprintf (idx_path, sizeof (idx_path), "%s.idx", path);
+
+  if (results_index_update (path))
+    return 1;
+
+  FILE *ix = fopen (idx_path, "rb");
+  FILE *log = fopen (path, "rb");
+  result_run runs[MAX_RESULT_RUNS];
+  unsigned long long covered;
+  long long end;
+  int nruns = ix != NULL ? index_load_runs (ix, runs, &covered, &end) : -1;
+
+  if (nruns < 0 || log == NULL)
+    {
+      if (ix != NULL)
+        fclose (ix);
+      if (log != NULL)
+        fclose (log);
+      return 1;
+    }
+
+  unsigned long long cfg = config_hash ();
+  unsigned long long n = 0;
+
+  for (int k = 0; k < nruns; k++)
+    {
+      runs[k].lo = index_lower_bound (ix, &runs[k], cfg, 0);
+      runs[k].hi = cfg == ~0ULL ? runs[k].count
+                                : index_lower_bound (ix, &runs[k], cfg + 1, 0);
+      n += runs[k].hi - runs[k].lo;
+    }
+
+  printf ("Leaderboard for %dx%d%s: %llu games\n", ROW, COLUMN,
+          endlessMode ? " endless" : "", n);
+
+  if (cascadeMode)
+    printf ("(cascade)\n");
+
+  if (n == 0)
+    {
+      fclose (ix);
+      fclose (log);
+      return 0;
+    }
+
+  printf ("  #      SCORE    LINES   PIECES   TIME (s)  SEED\n");
+
+  /* walk every run down from its best entry, always taking the best */
+  unsigned long long next[MAX_RESULT_RUNS];
+  result_entry head[MAX_RESULT_RUNS];
+
+  for (int k = 0; k < nruns; k++)
+    {
+      next[k] = runs[k].hi;
+
+      if (next[k] > runs[k].lo)
+        head[k] = index_entry (ix, &runs[k], next[k] - 1);
+    }
+
+  for (unsigned long long i = 0; i < (unsigned long long)top && i < n; i++)
+    {
+      int best = -1;
+
+      for (int k = 0; k < nruns; k++)
+        {
+          if (next[k] > runs[k].lo
+              && (best == -1 || result_entry_cmp (&head[k], &head[best]) > 0))
+            best = k;
+        }
+
+      result_entry e = head[best];
+      result_record r;
+
+      if (--next[best] > runs[best].lo)
+        head[best] = index_entry (ix, &runs[best], next[best] - 1);
+
+      _fseeki64 (log, e.record * sizeof (r), SEEK_SET);
+      fread (&r, sizeof (r), 1, log);
+
+      printf ("%3llu %10llu %8llu %8llu %10.1f  %llu\n", i + 1, r.score,
+              r.lines, r.pieces, r.duration_ms / 1000.0, r.seed);
+    }
+
+  unsigned long long min = ~0ULL, max = 0;
+
+  for (int k = 0; k < nruns; k++)
+    {
+      if (runs[k].hi == runs[k].lo)
+        continue;
+
+      unsigned long long a = index_entry (ix, &runs[k], runs[k].lo).score;
+      unsigned long long b = index_entry (ix, &runs[k], runs[k].hi - 1).score;
+
+      if (a < min)
+        min = a;
+      if (b > max)
+        max = b;
+    }
+
+  const int pct[] = { 50, 90, 99 };
+
+  printf ("\nPercentiles:");
+
+  for (size_t i = 0; i < sizeof (pct) / sizeof (pct[0]); i++)
+    {
+      /* lowest score with more than `rank` entries at or below it */
+      unsigned long long rank = (n - 1) * pct[i] / 100;
+      unsigned long long lo = min, hi = max;
+
+      while (lo < hi)
+        {
+          unsigned long long mid = lo + (hi - lo) / 2;
+
+          if (index_count_below (ix, runs, nruns, cfg, mid + 1) > rank)
+            hi = mid;
+          else
+            lo = mid + 1;
+        }
+
+      printf ("  p%d %llu", pct[i], lo);
+    }
+
+  unsigned long long width = (max - min) / HISTOGRAM_BUCKETS + 1;
+
+  printf ("  max %llu\n\nHistogram:\n", max);
+
+  unsigned long long from = 0;
+
+  for (int b = 0; b < HISTOGRAM_BUCKETS && from < n; b++)
+    {
+      unsigned long long edge = min + (b + 1) * width;
+      unsigned long long to = index_count_below (ix, runs, nruns, cfg, edge);
+
+      printf ("  %8llu - %-8llu %8llu  ", min + b * width, edge - 1,
+              to - from);
+
+      for (unsigned long long k = 0; k < (to - from) * 40 / n; k++)
+        putchar ('#');
+      putchar ('\n');
+
+      from = to;
+    }
+
+  fclose (ix);
+  fclose (log);
+
+  return 0;
+}
+#endif
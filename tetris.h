@@ -0,0 +1,51 @@
+/*
+ * File: tetris.h
+ * Author: Shrehan Raj Singh
+ * Created: 19-10-2026
+ * Description: Embedding API for the Tetris engine in main.c. Build the
+ *              `tetrisenv` library target to link against it.
+ */
+
+#ifndef TETRIS_H
+#define TETRIS_H
+
+#include <stddef.h>
+
+enum
+{
+  ACTION_NONE,
+  ACTION_LEFT,
+  ACTION_RIGHT,
+  ACTION_DOWN,
+  ACTION_SHIFT,
+  TOTAL_ACTIONS,
+};
+
+/*
+  A batch of independent games stepped in lockstep. The state is private
+  to the library; observations are `rows` bit-packed rows per environment
+  (bit j is column j). Finished environments are reset inside
+  tetris_batch_step().
+*/
+typedef struct tetris_batch tetris_batch;
+
+/*
+  Returns NULL for bad sizes (rows < 4, cols outside 3..64) or if the
+  batch cannot be allocated or its worker threads started.
+*/
+tetris_batch *tetris_batch_new (size_t n, int rows, int cols,
+                                unsigned int seed, int threads);
+void tetris_batch_free (tetris_batch *);
+void tetris_batch_reset (tetris_batch *, unsigned long long *obs_out);
+
+/*
+  Applies actions[i] then one tick of gravity to every environment.
+  obs_out receives n * rows bit-packed rows with the falling piece drawn
+  in; rewards_out the score gained this step; dones_out 1 where the game
+  ended (that environment's obs is already the first frame of a new game).
+*/
+void tetris_batch_step (tetris_batch *batch, const int *actions,
+                        unsigned long long *obs_out, float *rewards_out,
+                        unsigned char *dones_out);
+
+#endif